@@ -1,899 +1,6207 @@
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <vector>
-#include <string>
-#include <ctime>
-#include <algorithm>
-#include <limits>
-using namespace std;
-
-struct IssuedRecord {
-    string userID;    
-    string isbn;       
-    time_t issueTime;  
-};
-
-class Book {
-private:
-    string title;
-    string author;
-    string publisher;
-    int year;
-    string isbn;
-    string status;        
-    string reservedBy;    
-    time_t reservationExpiry; 
-public:
-    Book() : year(0), reservationExpiry(0) {}
-    Book(const string &t, const string &a, const string &p, int y, const string &i)
-      : title(t), author(a), publisher(p), year(y), isbn(i),
-        status("Available"), reservedBy(""), reservationExpiry(0) {}
-    string getTitle() const { return title; }
-    string getAuthor() const { return author; }
-    string getPublisher() const { return publisher; }
-    int getYear() const { return year; }
-    string getISBN() const { return isbn; }
-    string getStatus() const { return status; }
-    void setStatus(const string &s) { status = s; }
-    string getReservedBy() const { return reservedBy; }
-    void setReservedBy(const string &uid) { reservedBy = uid; }
-    time_t getReservationExpiry() const { return reservationExpiry; }
-    void setReservationExpiry(time_t t) { reservationExpiry = t; }
-    void display(const string &currentUserID = "") const {
-        cout << "Title     : " << title << "\n"
-             << "Author    : " << author << "\n"
-             << "Publisher : " << publisher << "\n"
-             << "Year      : " << year << "\n"
-             << "ISBN      : " << isbn << "\n";
-        if (status == "Reserved") {
-            time_t now = time(0);
-            if (currentUserID == reservedBy && now <= reservationExpiry)
-                cout << "Status    : Available (Reserved exclusively for you)\n";
-            else
-                cout << "Status    : Reserved\n";
-        } else {
-            cout << "Status    : " << status << "\n";
-        }
-        cout << "---------------------\n";
-    }
-
-    string toCSV() const {
-        stringstream ss;
-        ss << title << "," << author << "," << publisher << "," << year << "," << isbn << "," 
-           << status << "," << reservedBy << "," << reservationExpiry;
-        return ss.str();
-    }
-    static Book fromCSV(const string &line) {
-        stringstream ss(line);
-        string t, a, p, yearStr, i, s, rby, resExpStr;
-        getline(ss, t, ',');
-        getline(ss, a, ',');
-        getline(ss, p, ',');
-        getline(ss, yearStr, ',');
-        getline(ss, i, ',');
-        getline(ss, s, ',');
-        getline(ss, rby, ',');
-        getline(ss, resExpStr, ',');
-        Book book(t, a, p, stoi(yearStr), i);
-        book.setStatus(s);
-        book.setReservedBy(rby);
-        book.setReservationExpiry(resExpStr.empty() ? 0 : stol(resExpStr));
-        return book;
-    }
-};
-
-class Account {
-private:
-    vector<Book*> currentlyBorrowed;
-    double fineAmount;
-    bool fineSettlementPending; 
-public:
-    Account() : fineAmount(0.0), fineSettlementPending(false) {}
-    void addBorrowedBook(Book* book) { currentlyBorrowed.push_back(book); }
-    void removeBorrowedBook(Book* book) {
-        auto it = find(currentlyBorrowed.begin(), currentlyBorrowed.end(), book);
-        if (it != currentlyBorrowed.end())
-            currentlyBorrowed.erase(it);
-    }
-    void addFine(double fine) { fineAmount += fine; }
-    void clearFine() { fineAmount = 0.0; }
-    double getFine() const { return fineAmount; }
-    size_t getBorrowedCount() const { return currentlyBorrowed.size(); }
-    bool isFineSettlementPending() const { return fineSettlementPending; }
-    void requestFineSettlement() { fineSettlementPending = true; }
-    void approveFineSettlement() { fineSettlementPending = false; clearFine(); }
-    void displayBorrowedBooks() const {
-        if(currentlyBorrowed.empty()){
-            cout << "You have not borrowed any books.\n";
-            return;
-        }
-        for(auto book : currentlyBorrowed) {
-            book->display();
-        }
-    }
-};
-
-class User {
-protected:
-    string id;
-    string name;
-    string password;
-    string role; 
-    Account account;
-public:
-    User() {}
-    User(const string &uid, const string &uname, const string &pass, const string &r)
-      : id(uid), name(uname), password(pass), role(r) {}
-    bool verifyPassword(const string &pass) const { return password == pass; }
-    virtual void borrowBook(Book* book) = 0;
-    virtual void returnBook(Book* book, int daysBorrowed) = 0;
-    string getID() const { return id; }
-    string getName() const { return name; }
-    string getRole() const { return role; }
-    Account& getAccount() { return account; }
-    virtual void display() const {
-        cout << "User ID: " << id << ", Name: " << name << ", Role: " << role 
-             << ", Fine: " << account.getFine() << "\n";
-    }
-    string toCSV() const {
-        stringstream ss;
-        ss << id << "," << name << "," << password << "," << role << "," << account.getFine();
-        return ss.str();
-    }
-    virtual ~User() {}
-};
-
-class Student : public User {
-private:
-    static const int maxBooks = 3;
-    static const int borrowingPeriod = 15;
-    const int fineRate = 10;
-public:
-    Student(const string &uid, const string &uname, const string &pass)
-      : User(uid, uname, pass, "Student") {}
-    virtual void borrowBook(Book* book) override {
-        if(account.getFine() > 0 || account.isFineSettlementPending()) {
-            cout << "You have an outstanding fine. Please clear fines before borrowing new books.\n";
-            return;
-        }
-        if(account.getBorrowedCount() >= maxBooks) {
-            cout << "You have reached your borrowing limit of " << maxBooks << " books.\n";
-            return;
-        }
-        if(book->getStatus() == "Available") {
-            book->setStatus("Borrowed");
-            account.addBorrowedBook(book);
-            cout << "Book successfully borrowed by student " << name << ".\n";
-        }
-        else if(book->getStatus() == "Reserved") {
-            time_t now = time(0);
-            if(book->getReservedBy() == id && now <= book->getReservationExpiry()){
-                book->setStatus("Borrowed");
-                book->setReservedBy("");
-                book->setReservationExpiry(0);
-                account.addBorrowedBook(book);
-                cout << "Book successfully borrowed (from reservation) by student " << name << ".\n";
-            } else {
-                cout << "Book is reserved by another user.\n";
-            }
-        }
-        else {
-            cout << "Book is not available.\n";
-        }
-    }
-    virtual void returnBook(Book* book, int daysBorrowed) override {
-        book->setStatus("Available");
-        account.removeBorrowedBook(book);
-        if(daysBorrowed > borrowingPeriod) {
-            int overdue = daysBorrowed - borrowingPeriod;
-            double fine = overdue * fineRate;
-            account.addFine(fine);
-            cout << "Book returned after " << daysBorrowed << " days. Fine of " << fine << " rupees applied.\n";
-        }
-        else {
-            cout << "Book returned on time.\n";
-        }
-        if(!book->getReservedBy().empty()) {
-            book->setStatus("Reserved");
-            book->setReservationExpiry(time(0) + 5 * 24 * 3600); 
-            cout << "Book will be reserved exclusively for user " << book->getReservedBy() << " for 5 days.\n";
-        }
-    }
-    virtual void display() const override {
-        cout << "Student: ";
-        User::display();
-    }
-};
-
-class Faculty : public User {
-private:
-    static const int maxBooks = 5;
-    static const int borrowingPeriod = 30; 
-public:
-    Faculty(const string &uid, const string &uname, const string &pass)
-      : User(uid, uname, pass, "Faculty") {}
-    virtual void borrowBook(Book* book) override {
-        if(account.getFine() > 0) {
-            cout << "You have an outstanding fine. Please clear it before borrowing new books.\n";
-            return;
-        }
-        if(account.getBorrowedCount() >= maxBooks) {
-            cout << "You have reached your borrowing limit of " << maxBooks << " books.\n";
-            return;
-        }
-        if(book->getStatus() == "Available") {
-            book->setStatus("Borrowed");
-            account.addBorrowedBook(book);
-            cout << "Book successfully borrowed by faculty " << name << ".\n";
-        }
-        else if(book->getStatus() == "Reserved") {
-            time_t now = time(0);
-            if(book->getReservedBy() == id && now <= book->getReservationExpiry()){
-                book->setStatus("Borrowed");
-                book->setReservedBy("");
-                book->setReservationExpiry(0);
-                account.addBorrowedBook(book);
-                cout << "Book successfully borrowed (from reservation) by faculty " << name << ".\n";
-            } else {
-                cout << "Book is reserved by another user.\n";
-            }
-        }
-        else {
-            cout << "Book is not available.\n";
-        }
-    }
-    virtual void returnBook(Book* book, int daysBorrowed) override {
-        book->setStatus("Available");
-        account.removeBorrowedBook(book);
-        cout << "Book returned successfully.\n";
-        if(!book->getReservedBy().empty()){
-            book->setStatus("Reserved");
-            book->setReservationExpiry(time(0) + 5 * 24 * 3600);
-            cout << "Book is now reserved exclusively for user " << book->getReservedBy() << " for 5 days.\n";
-        }
-    } 
-    virtual void display() const override {
-        cout << "Faculty: ";
-        User::display();
-    }
-};
-
-class Librarian : public User {
-public:
-    Librarian(const string &uid, const string &uname, const string &pass)
-      : User(uid, uname, pass, "Librarian") {}
-    virtual void borrowBook(Book* ) override {
-        cout << "Librarians cannot borrow books.\n";
-    }
-    virtual void returnBook(Book*, int ) override {
-        cout << "Librarians cannot return books.\n";
-    }
-    virtual void display() const override {
-        cout << "Librarian: ";
-        User::display();
-    }
-};
-
-class Library {
-private:
-    vector<Book> books;
-    vector<User*> users;
-    vector<IssuedRecord> issued;
-public:
-    void addNewBook(const Book &b) {
-        if(searchBookByISBN(b.getISBN()) != nullptr) {
-            cout << "A book with ISBN " << b.getISBN() << " already exists. Not added.\n";
-            return;
-        }
-        books.push_back(b);
-        saveBooks("books.csv");
-    }
-    Book* searchBookByISBN(const string &isbn) {
-        for(auto &b : books)
-            if(b.getISBN() == isbn)
-                return &b;
-        return nullptr;
-    }
-    void displayAllBooks(const string &currentUserID = "") {
-        cout << "\n--- All Books ---\n";
-        for(const Book &b : books)
-            b.display(currentUserID);
-    }
-    void addNewUser(User* u) {
-        if(getUserById(u->getID()) != nullptr) {
-            cout << "A user with ID " << u->getID() << " already exists. Not added.\n";
-            delete u;
-            return;
-        }
-        users.push_back(u);
-        saveUsers("users.csv");
-    }
-    User* getUserById(const string &uid) {
-        for(auto u : users)
-            if(u->getID() == uid)
-                return u;
-        return nullptr;
-    }
-    void displayAllUsers() {
-        cout << "\n--- All Users ---\n";
-        for(const User* u : users) {
-            u->display();
-            cout << "---------------------\n";
-        }
-    }
-    void removeUserIfPossible(const string &uid) {
-        User* u = getUserById(uid);
-        if(!u) {
-            cout << "User not found.\n";
-            return;
-        }
-        if(u->getAccount().getBorrowedCount() > 0) {
-            cout << "Cannot remove user " << uid << " because they have borrowed books.\n";
-            return;
-        }
-        users.erase(remove_if(users.begin(), users.end(), [&](User* x){ return x->getID() == uid; }), users.end());
-        delete u;
-        cout << "User " << uid << " removed successfully.\n";
-        saveUsers("users.csv");
-    }
-    void issueBook(const string &uid, const string &isbn) {
-        Book* book = searchBookByISBN(isbn);
-        if(!book) {
-            cout << "Book with ISBN " << isbn << " not found.\n";
-            return;
-        }
-        if(book->getStatus() == "Borrowed") {
-            cout << "Book is already issued.\n";
-            return;
-        }
-        if(book->getStatus() == "Reserved") {
-            time_t now = time(0);
-            if(book->getReservedBy() != uid || now > book->getReservationExpiry()){
-                cout << "Book is reserved by another user.\n";
-                return;
-            }
-        }
-        User* u = getUserById(uid);
-        if(u && (u->getAccount().getFine() > 0 || u->getAccount().isFineSettlementPending())) {
-            cout << "Outstanding fine exists. Clear fines before borrowing.\n";
-            return;
-        }
-        u->borrowBook(book); 
-        if(book->getStatus() == "Borrowed") {
-            IssuedRecord rec { uid, isbn, time(0) };
-            issued.push_back(rec);
-            saveBooks("books.csv");
-            saveIssued("issued.csv");
-            cout << "Book (ISBN " << isbn << ") issued to user " << uid << ".\n";
-        }
-    }
-    void returnBook(const string &uid, const string &isbn, int daysBorrowed) {
-        Book* book = searchBookByISBN(isbn);
-        if(!book) {
-            cout << "Book with ISBN " << isbn << " not found.\n";
-            return;
-        }
-        auto it = remove_if(issued.begin(), issued.end(), [&](const IssuedRecord &r) {
-            return r.userID == uid && r.isbn == isbn;
-        });
-        if(it != issued.end())
-            issued.erase(it, issued.end());
-        User* u = getUserById(uid);
-        if(u)
-            u->returnBook(book, daysBorrowed);
-        if(!book->getReservedBy().empty()) {
-            book->setStatus("Reserved");
-            book->setReservationExpiry(time(0) + 5 * 24 * 3600);
-            cout << "Book is now reserved exclusively for user " << book->getReservedBy() << " for 5 days.\n";
-        } else {
-            book->setStatus("Available");
-        }
-        saveBooks("books.csv");
-        saveIssued("issued.csv");
-        saveUsers("users.csv");
-    }
-    void displayIssuedRecords() {
-        cout << "\n--- Issued Records ---\n";
-        if(issued.empty()) {
-            cout << "No books are currently issued.\n";
-            return;
-        }
-        for(const IssuedRecord &r : issued) {
-            cout << "User ID: " << r.userID << ", ISBN: " << r.isbn
-                 << ", Issue Date: " << ctime(&r.issueTime);
-        }
-    }
-    void displayBorrowingDetails() {
-        cout << "\n--- Borrowing Details ---\n";
-        if(issued.empty()){
-            cout << "No books are currently issued.\n";
-            return;
-        }
-        for(const IssuedRecord &r : issued) {
-            cout << "User ID: " << r.userID << ", ISBN: " << r.isbn
-                 << ", Issue Date: " << ctime(&r.issueTime);
-        }
-    }
-    void reserveBook(const string &uid, const string &isbn) {
-        Book* book = searchBookByISBN(isbn);
-        if(!book) {
-            cout << "Book with ISBN " << isbn << " not found.\n";
-            return;
-        }
-        if(book->getStatus() != "Borrowed") {
-            cout << "Book is available; you may borrow it.\n";
-            return;
-        }
-        if(!book->getReservedBy().empty()) {
-            cout << "Book is already reserved by another user.\n";
-            return;
-        }
-        book->setReservedBy(uid);
-        cout << "Book reserved successfully. Once returned, it will be available exclusively for you for 5 days.\n";
-        saveBooks("books.csv");
-    }
-    void loadBooks(const string &filename) {
-        ifstream inFile(filename);
-        if(!inFile) {
-            cout << "Books file \"" << filename << "\" not found. It will be created on saving.\n";
-            return;
-        }
-        books.clear();
-        string line;
-        while(getline(inFile, line)) {
-            if(line.empty()) continue;
-            Book book = Book::fromCSV(line);
-            books.push_back(book);
-        }
-        inFile.close();
-        cout << "Loaded books from \"" << filename << "\"\n";
-    }
-    void saveBooks(const string &filename) {
-        ofstream outFile(filename);
-        if(!outFile) {
-            cout << "Error writing to \"" << filename << "\"\n";
-            return;
-        }
-        for(const Book &b : books)
-            outFile << b.toCSV() << "\n";
-        outFile.close();
-        cout << "Saved books to \"" << filename << "\"\n";
-    }
-    void loadUsers(const string &filename) {
-        ifstream inFile(filename);
-        if(!inFile) {
-            cout << "Users file \"" << filename << "\" not found. It will be created on saving.\n";
-            return;
-        }
-        users.clear();
-        string line;
-        while(getline(inFile, line)) {
-            if(line.empty()) continue;
-            stringstream ss(line);
-            vector<string> tokens;
-            string token;
-            while(getline(ss, token, ','))
-                tokens.push_back(token);
-            if(tokens.size() < 5) continue;
-            string uid = tokens[0], uname = tokens[1], upass = tokens[2], urole = tokens[3];
-            double ufine = stod(tokens[4]);
-            User* u = nullptr;
-            if(urole == "Student")
-                u = new Student(uid, uname, upass);
-            else if(urole == "Faculty")
-                u = new Faculty(uid, uname, upass);
-            else if(urole == "Librarian")
-                u = new Librarian(uid, uname, upass);
-            if(u) {
-                u->getAccount().clearFine();
-                u->getAccount().addFine(ufine);
-                users.push_back(u);
-            }
-        }
-        inFile.close();
-        cout << "Loaded users from \"" << filename << "\"\n";
-    }
-    void saveUsers(const string &filename) {
-        ofstream outFile(filename);
-        if(!outFile) {
-            cout << "Error writing to \"" << filename << "\"\n";
-            return;
-        }
-        for(const User* u : users)
-            outFile << u->toCSV() << "\n";
-        outFile.close();
-        cout << "Saved users to \"" << filename << "\"\n";
-    }
-    void loadIssued(const string &filename) {
-        ifstream inFile(filename);
-        if(!inFile) {
-            cout << "Issued records file \"" << filename << "\" not found. It will be created on saving.\n";
-            return;
-        }
-        issued.clear();
-        string line;
-        while(getline(inFile, line)) {
-            if(line.empty()) continue;
-            stringstream ss(line);
-            string uid, isbn, timeStr;
-            getline(ss, uid, ',');
-            getline(ss, isbn, ',');
-            getline(ss, timeStr, ',');
-            IssuedRecord rec { uid, isbn, static_cast<time_t>(stol(timeStr)) };
-            issued.push_back(rec);
-        }
-        inFile.close();
-        cout << "Loaded issued records from \"" << filename << "\"\n";
-    }
-    void saveIssued(const string &filename) {
-        ofstream outFile(filename);
-        if(!outFile) {
-            cout << "Error writing to \"" << filename << "\"\n";
-            return;
-        }
-        for(const IssuedRecord &r : issued)
-            outFile << r.userID << "," << r.isbn << "," << r.issueTime << "\n";
-        outFile.close();
-        cout << "Saved issued records to \"" << filename << "\"\n";
-    }
-    void loadAllData() {
-        loadBooks("books.csv");
-        loadUsers("users.csv");
-        loadIssued("issued.csv");
-    }
-    void saveAllData() {
-        saveBooks("books.csv");
-        saveUsers("users.csv");
-        saveIssued("issued.csv");
-    }
-    ~Library() {
-        for(auto u : users)
-            delete u;
-    }
-};
-
-void studentMenu(Library &lib, User* user) {
-    int choice;
-    while (true) {
-        cout << "\n--- Student Menu (" << user->getName() << ") ---\n";
-        cout << "1. View All Books\n";
-        cout << "2. Borrow Book\n";
-        cout << "3. Reserve Book\n";
-        cout << "4. Return Book\n";
-        cout << "5. View Outstanding Fine\n";
-        cout << "6. Request Fine Clearance\n";
-        cout << "7. View Currently Borrowed Books\n";
-        cout << "8. Logout\n";
-        cout << "Enter your choice: ";
-        if(!(cin >> choice)) {
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "Invalid input. Try again.\n";
-            continue;
-        }
-        if(choice == 8) break;
-        switch(choice) {
-            case 1:
-                lib.displayAllBooks(user->getID());
-                break;
-            case 2:
-                if(user->getAccount().getFine() > 0 || user->getAccount().isFineSettlementPending()){
-                    cout << "Cannot borrow new books until outstanding fines are cleared.\n";
-                } else {
-                    {
-                      string isbn;
-                      cout << "Enter ISBN to borrow: ";
-                      cin >> isbn;
-                      lib.issueBook(user->getID(), isbn);
-                    }
-                }
-                break;
-            case 3:
-                {
-                    string isbn;
-                    cout << "Enter ISBN to reserve: ";
-                    cin >> isbn;
-                    lib.reserveBook(user->getID(), isbn);
-                }
-                break;
-            case 4:
-                {
-                    string isbn;
-                    int days;
-                    cout << "Enter ISBN to return: ";
-                    cin >> isbn;
-                    cout << "Enter number of days since issue: ";
-                    cin >> days;
-                    lib.returnBook(user->getID(), isbn, days);
-                }
-                break;
-            case 5:
-                cout << "Outstanding fine: " << user->getAccount().getFine() << " rupees\n";
-                break;
-            case 6:
-                if(user->getAccount().getFine() > 0 && !user->getAccount().isFineSettlementPending()){
-                    user->getAccount().requestFineSettlement();
-                    lib.saveUsers("users.csv");
-                    cout << "Your fine clearance request has been sent for librarian approval.\n";
-                } else if(user->getAccount().isFineSettlementPending()){
-                    cout << "Your fine clearance request is pending approval.\n";
-                } else {
-                    cout << "No fine to clear.\n";
-                }
-                break;
-            case 7:
-                user->getAccount().displayBorrowedBooks();
-                break;
-            default:
-                cout << "Invalid choice. Please try again.\n";
-                break;
-        }
-    }
-}
-
-void facultyMenu(Library &lib, User* user) {
-    int choice;
-    while (true) {
-        cout << "\n--- Faculty Menu (" << user->getName() << ") ---\n";
-        cout << "1. View All Books\n";
-        cout << "2. Borrow Book\n";
-        cout << "3. Reserve Book\n";
-        cout << "4. Return Book\n";
-        cout << "5. View Currently Borrowed Books\n";
-        cout << "6. Logout\n";
-        cout << "Enter your choice: ";
-        if(!(cin >> choice)) {
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "Invalid input. Try again.\n";
-            continue;
-        }
-        if(choice == 6) break;
-        switch(choice) {
-            case 1:
-                lib.displayAllBooks(user->getID());
-                break;
-            case 2:
-                if(user->getAccount().getFine() > 0){
-                    cout << "Outstanding fine exists. Clear it before borrowing new books.\n";
-                } else {
-                    {
-                      string isbn;
-                      cout << "Enter ISBN to borrow: ";
-                      cin >> isbn;
-                      lib.issueBook(user->getID(), isbn);
-                    }
-                }
-                break;
-            case 3:
-                {
-                    string isbn;
-                    cout << "Enter ISBN to reserve: ";
-                    cin >> isbn;
-                    lib.reserveBook(user->getID(), isbn);
-                }
-                break;
-            case 4:
-                {
-                    string isbn;
-                    int days;
-                    cout << "Enter ISBN to return: ";
-                    cin >> isbn;
-                    cout << "Enter number of days since issue: ";
-                    cin >> days;
-                    lib.returnBook(user->getID(), isbn, days);
-                }
-                break;
-            case 5:
-                user->getAccount().displayBorrowedBooks();
-                break;
-            default:
-                cout << "Invalid choice. Please try again.\n";
-                break;
-        }
-    }
-}
-
-void librarianMenu(Library &lib, User* user) {
-    int choice;
-    while (true) {
-        cout << "\n--- Librarian Menu (" << user->getName() << ") ---\n";
-        cout << "1. Add Book\n";
-        cout << "2. Add User\n";
-        cout << "3. Remove User\n";
-        cout << "4. Search Book by ISBN\n";
-        cout << "5. List All Books\n";
-        cout << "6. View Borrowing Details\n";
-        cout << "7. List All Users\n";
-        cout << "8. Approve Fine Clearance for a User\n";
-        cout << "9. Logout\n";
-        cout << "Enter your choice: ";
-        if(!(cin >> choice)) {
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "Invalid input. Try again.\n";
-            continue;
-        }
-        if(choice == 9) break;
-        switch(choice) {
-            case 1:
-                {
-                    string title, author, publisher, isbn;
-                    int year;
-                    cout << "Enter title: ";
-                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                    getline(cin, title);
-                    cout << "Enter author: ";
-                    getline(cin, author);
-                    cout << "Enter publisher: ";
-                    getline(cin, publisher);
-                    cout << "Enter year: ";
-                    cin >> year;
-                    cout << "Enter ISBN: ";
-                    cin >> isbn;
-                    if(lib.searchBookByISBN(isbn) != nullptr) {
-                        cout << "Book with ISBN " << isbn << " already exists. Cannot add duplicate.\n";
-                    } else {
-                        Book newBook(title, author, publisher, year, isbn);
-                        lib.addNewBook(newBook);
-                    }
-                }
-                break;
-            case 2:
-                {
-                    string uid, uname, upass, role;
-                    cout << "Enter new User ID: ";
-                    cin >> uid;
-                    if(lib.getUserById(uid) != nullptr) {
-                        cout << "User with ID " << uid << " already exists. Cannot add duplicate.\n";
-                        break;
-                    }
-                    cout << "Enter name: ";
-                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                    getline(cin, uname);
-                    cout << "Enter password: ";
-                    cin >> upass;
-                    cout << "Enter role (Student/Faculty): ";
-                    cin >> role;
-                    if(role != "Student" && role != "Faculty") {
-                        cout << "Invalid role. Only Student or Faculty allowed.\n";
-                        break;
-                    }
-                    User* newUser = (role == "Student") ? static_cast<User*>(new Student(uid, uname, upass)): static_cast<User*>(new Faculty(uid, uname, upass));
-                    lib.addNewUser(newUser);
-                    cout << "User added successfully.\n";
-                }
-                break;
-            case 3:
-                {
-                    string uid;
-                    cout << "Enter User ID to remove: ";
-                    cin >> uid;
-                    lib.removeUserIfPossible(uid);
-                }
-                break;
-            case 4:
-                {
-                    string isbn;
-                    cout << "Enter ISBN to search: ";
-                    cin >> isbn;
-                    Book* b = lib.searchBookByISBN(isbn);
-                    if(b) b->display();
-                    else cout << "Book not found.\n";
-                }
-                break;
-            case 5:
-                lib.displayAllBooks();
-                break;
-            case 6:
-                lib.displayBorrowingDetails();
-                break;
-            case 7:
-                lib.displayAllUsers();
-                break;
-            case 8:
-                {
-                    string uid;
-                    cout << "Enter User ID to approve fine clearance: ";
-                    cin >> uid;
-                    User* u = lib.getUserById(uid);
-                    if(u && u->getAccount().isFineSettlementPending()){
-                        u->getAccount().approveFineSettlement();
-                        lib.saveUsers("users.csv");
-                        cout << "Fine for user " << uid << " has been approved and cleared.\n";
-                    } else {
-                        cout << "No pending fine clearance for this user or user not found.\n";
-                    }
-                }
-                break;
-            default:
-                cout << "Invalid choice. Please try again.\n";
-                break;
-        }
-    }
-}
-
-User* login(Library &lib) {
-    string uid, pass;
-    cout << "Enter User ID: ";
-    cin >> uid;
-    cout << "Enter Password: ";
-    cin >> pass;
-    User* user = lib.getUserById(uid);
-    if(!user) {
-        cout << "User not found.\n";
-        return nullptr;
-    }
-    if(!user->verifyPassword(pass)){
-        cout << "Invalid password.\n";
-        return nullptr;
-    }
-    return user;
-}
-
-int main(){
-    Library library;
-    library.loadBooks("books.csv");
-    library.loadUsers("users.csv");
-    library.loadIssued("issued.csv");
-    if(library.searchBookByISBN("ISBN-001") == nullptr) {
-        library.addNewBook(Book("C++ Primer", "Stanley Lippman", "Addison-Wesley", 2012, "ISBN-001"));
-        library.addNewBook(Book("Effective C++", "Scott Meyers", "O'Reilly", 2005, "ISBN-002"));
-        library.addNewBook(Book("The C++ Programming Language", "Bjarne Stroustrup", "Addison-Wesley", 2013, "ISBN-003"));
-        library.addNewBook(Book("Programming: Principles and Practice", "Bjarne Stroustrup", "Addison-Wesley", 2014, "ISBN-004"));
-        library.addNewBook(Book("Modern C++ Design", "Andrei Alexandrescu", "Addison-Wesley", 2001, "ISBN-005"));
-        library.addNewBook(Book("C++ Concurrency in Action", "Anthony Williams", "Manning", 2019, "ISBN-006"));
-        library.addNewBook(Book("Clean Code", "Robert C. Martin", "Prentice Hall", 2008, "ISBN-007"));
-        library.addNewBook(Book("Design Patterns", "Erich Gamma", "Addison-Wesley", 1994, "ISBN-008"));
-        library.addNewBook(Book("Effective STL", "Scott Meyers", "O'Reilly", 2001, "ISBN-009"));
-        library.addNewBook(Book("The Pragmatic Programmer", "Andrew Hunt", "Addison-Wesley", 1999, "ISBN-010"));
-        library.saveBooks("books.csv");
-    }
-    if(library.getUserById("1") == nullptr) {
-        library.addNewUser(new Student("1", "Alice", "alicepwd"));
-        library.addNewUser(new Student("2", "Bob", "bobpwd"));
-        library.addNewUser(new Student("3", "Charlie", "charliepwd"));
-        library.addNewUser(new Student("4", "David", "davidpwd"));
-        library.addNewUser(new Student("5", "Eva", "evapwd"));
-        library.addNewUser(new Faculty("6", "Prof. Smith", "smithpwd"));
-        library.addNewUser(new Faculty("7", "Prof. Johnson", "johnsonpwd"));
-        library.addNewUser(new Faculty("8", "Prof. Williams", "williampwd"));
-        library.addNewUser(new Librarian("9", "Librarian Karen", "karenpwd"));
-        library.saveUsers("users.csv");
-    }   
-    int mainChoice;
-    while (true) {
-        cout << "\n--- Library Management System ---\n";
-        cout << "1. Login\n";
-        cout << "2. Exit\n";
-        cout << "Enter your choice: ";
-        if(!(cin >> mainChoice)) {
-            cin.clear();
-            cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            cout << "Invalid input. Try again.\n";
-            continue;
-        }
-        if(mainChoice == 2)
-            break;
-        if(mainChoice != 1) {
-            cout << "Invalid choice.\n";
-            continue;
-        }
-        User* currentUser = login(library);
-        if(!currentUser)
-            continue;
-        string role = currentUser->getRole();
-        if(role == "Student")
-            studentMenu(library, currentUser);
-        else if(role == "Faculty")
-            facultyMenu(library, currentUser);
-        else if(role == "Librarian")
-            librarianMenu(library, currentUser);
-    }
-    library.saveBooks("books.csv");
-    library.saveUsers("users.csv");
-    library.saveIssued("issued.csv");
-    cout << "Goodbye!\n";
-    return 0;
-}
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <ctime>
+#include <algorithm>
+#include <unordered_map>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <cerrno>
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <thread>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <csignal>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+using namespace std;
+
+// Quotes a field only when it contains a separator, quote or line break.
+string csvField(string_view field) {
+    if(field.find_first_of(",\"\n\r") == string_view::npos)
+        return string(field);
+    string out = "\"";
+    for(char c : field) {
+        if(c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
+    return out;
+}
+
+string jsonString(string_view text) {
+    string out = "\"";
+    for(char c : text) {
+        switch(c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if(static_cast<unsigned char>(c) < 0x20) {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+    return out;
+}
+
+// Same text as streaming the amount with the default ostream settings.
+string formatAmount(double amount) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%g", amount);
+    return buf;
+}
+
+template <typename T>
+bool parseNumber(string_view text, T &value) {
+    auto result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size();
+}
+
+// Instrumentation for the hot paths, compiled in with -DLMS_METRICS.
+// Without it the METRIC_* macros expand to nothing.
+#ifdef LMS_METRICS
+// Latencies in nanoseconds, bucketed like HdrHistogram: values below 16
+// are exact and every power of two above is split into 8 linear buckets,
+// so a percentile is reported within 12.5% of the true value. Buckets are
+// relaxed atomics, so desks record without taking a lock.
+class LatencyHistogram {
+private:
+    static const size_t bucketCount = 8 * 48;
+    array<atomic<uint64_t>, bucketCount> buckets {};
+    atomic<uint64_t> maxNanos { 0 };
+    static size_t bucketOf(uint64_t nanos) {
+        size_t shift = 0;
+        while((nanos >> shift) >= 16)
+            ++shift;
+        return min(bucketCount - 1, shift * 8 + static_cast<size_t>(nanos >> shift));
+    }
+    static uint64_t highestIn(size_t bucket) {
+        if(bucket < 16)
+            return bucket;
+        size_t shift = bucket / 8 - 1;
+        return ((bucket % 8 + 9) << shift) - 1;
+    }
+public:
+    void record(uint64_t nanos) {
+        buckets[bucketOf(nanos)].fetch_add(1, memory_order_relaxed);
+        uint64_t seen = maxNanos.load(memory_order_relaxed);
+        while(nanos > seen && !maxNanos.compare_exchange_weak(seen, nanos, memory_order_relaxed)) {}
+    }
+    uint64_t percentile(double p, uint64_t total) const {
+        uint64_t rank = static_cast<uint64_t>(p * total), seen = 0;
+        for(size_t b = 0; b < bucketCount; ++b) {
+            seen += buckets[b].load(memory_order_relaxed);
+            if(seen > rank)
+                return min(highestIn(b), maxNanos.load(memory_order_relaxed));
+        }
+        return maxNanos.load(memory_order_relaxed);
+    }
+    uint64_t max() const { return maxNanos.load(memory_order_relaxed); }
+};
+
+class Metrics {
+public:
+    enum Timer : uint8_t {
+        IssueBook, ReturnBook, ReserveBook, BorrowRules, SearchCatalog, Login, Checkpoint,
+        LoadBooks, LoadUsers, LoadIssued, LoadSnapshot, LoadSegment,
+        SaveBooks, SaveUsers, SaveIssued, SaveSnapshot, SaveSegment, SaveHistory, SyncJournal,
+        timerCount
+    };
+    enum Counter : uint8_t { IsbnIndexHits, IsbnIndexMisses, UserIndexHits, UserIndexMisses, JournalBytes, counterCount };
+private:
+    struct TimerStats {
+        atomic<uint64_t> calls { 0 }, failures { 0 }, bytes { 0 }, totalNanos { 0 };
+        LatencyHistogram latency;
+    };
+    array<TimerStats, timerCount> timers;
+    array<atomic<uint64_t>, counterCount> counters {};
+public:
+    void record(Timer t, uint64_t nanos, bool ok, uint64_t bytes) {
+        TimerStats &stats = timers[t];
+        stats.calls.fetch_add(1, memory_order_relaxed);
+        if(!ok) stats.failures.fetch_add(1, memory_order_relaxed);
+        stats.bytes.fetch_add(bytes, memory_order_relaxed);
+        stats.totalNanos.fetch_add(nanos, memory_order_relaxed);
+        stats.latency.record(nanos);
+    }
+    void count(Counter c, uint64_t n) { counters[c].fetch_add(n, memory_order_relaxed); }
+    // One JSON object; timers that never ran are left out.
+    string toJSON() const {
+        static const char* timerNames[] = {
+            "issueBook", "returnBook", "reserveBook", "borrowRules", "searchCatalog", "login", "checkpoint",
+            "loadBooks", "loadUsers", "loadIssued", "loadSnapshot", "loadSegment",
+            "saveBooks", "saveUsers", "saveIssued", "saveSnapshot", "saveSegment", "saveHistory", "syncJournal" };
+        static const char* counterNames[] = {
+            "isbnIndexHits", "isbnIndexMisses", "userIndexHits", "userIndexMisses", "journalBytes" };
+        auto micros = [](uint64_t nanos) { return formatAmount(nanos / 1000.0); };
+        string out = "{\"timers\":{";
+        bool first = true;
+        for(size_t t = 0; t < timerCount; ++t) {
+            const TimerStats &stats = timers[t];
+            uint64_t calls = stats.calls.load(memory_order_relaxed);
+            if(calls == 0) continue;
+            if(!first) out += ',';
+            first = false;
+            out += '"'; out += timerNames[t]; out += "\":{\"calls\":"; out += to_string(calls);
+            out += ",\"failures\":"; out += to_string(stats.failures.load(memory_order_relaxed));
+            out += ",\"bytes\":"; out += to_string(stats.bytes.load(memory_order_relaxed));
+            out += ",\"meanUs\":"; out += micros(stats.totalNanos.load(memory_order_relaxed) / calls);
+            out += ",\"p50Us\":"; out += micros(stats.latency.percentile(0.50, calls));
+            out += ",\"p90Us\":"; out += micros(stats.latency.percentile(0.90, calls));
+            out += ",\"p99Us\":"; out += micros(stats.latency.percentile(0.99, calls));
+            out += ",\"maxUs\":"; out += micros(stats.latency.max());
+            out += '}';
+        }
+        out += "},\"counters\":{";
+        for(size_t c = 0; c < counterCount; ++c) {
+            if(c) out += ',';
+            out += '"'; out += counterNames[c]; out += "\":"; out += to_string(counters[c].load(memory_order_relaxed));
+        }
+        out += "}}";
+        return out;
+    }
+};
+
+Metrics metrics;
+
+// Times its scope into one of the Metrics timers.
+class MetricTimer {
+private:
+    Metrics::Timer timer;
+    chrono::steady_clock::time_point started;
+public:
+    bool ok = true;
+    uint64_t bytes = 0;
+    explicit MetricTimer(Metrics::Timer t) : timer(t), started(chrono::steady_clock::now()) {}
+    MetricTimer(const MetricTimer&) = delete;
+    MetricTimer& operator=(const MetricTimer&) = delete;
+    ~MetricTimer() {
+        auto nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+        metrics.record(timer, static_cast<uint64_t>(nanos), ok, bytes);
+    }
+};
+
+#define METRIC_TIMER(name, timer) MetricTimer name(Metrics::timer)
+#define METRIC_OUTCOME(name, success) (name.ok = (success))
+#define METRIC_BYTES(name, count) (name.bytes = (count))
+#define METRIC_COUNT(counter, n) metrics.count(Metrics::counter, (n))
+#else
+#define METRIC_TIMER(name, timer)
+#define METRIC_OUTCOME(name, success)
+#define METRIC_BYTES(name, count)
+#define METRIC_COUNT(counter, n)
+#endif
+
+// Splits one CSV record into views over the line. Unquoted fields are not
+// copied; quoted fields are unescaped into a scratch buffer reserved up
+// front so earlier views stay valid. Reusing one CsvRow across lines keeps
+// parsing allocation-free once the buffers have grown.
+class CsvRow {
+private:
+    vector<string_view> fields;
+    string scratch;
+public:
+    bool parse(string_view line) {
+        fields.clear();
+        scratch.clear();
+        scratch.reserve(line.size());
+        size_t i = 0;
+        while(true) {
+            if(i < line.size() && line[i] == '"') {
+                size_t start = scratch.size();
+                ++i;
+                while(true) {
+                    if(i >= line.size()) return false;
+                    if(line[i] == '"') {
+                        if(i + 1 < line.size() && line[i + 1] == '"') {
+                            scratch += '"';
+                            i += 2;
+                            continue;
+                        }
+                        ++i;
+                        break;
+                    }
+                    scratch += line[i++];
+                }
+                fields.emplace_back(scratch.data() + start, scratch.size() - start);
+                if(i < line.size() && line[i] != ',') return false;
+            } else {
+                size_t end = line.find(',', i);
+                if(end == string_view::npos) end = line.size();
+                fields.push_back(line.substr(i, end - i));
+                i = end;
+            }
+            if(i >= line.size()) return true;
+            ++i;
+        }
+    }
+    size_t size() const { return fields.size(); }
+    string_view operator[](size_t i) const { return i < fields.size() ? fields[i] : string_view(); }
+};
+
+// Reads a file in large blocks and hands out one line at a time as a view
+// into the block buffer; a view is valid until the next call. A newline
+// inside a quoted field belongs to the field, so a line runs on to the
+// first newline outside quotes. As in CsvRow, a quote only opens a field
+// at its start.
+class CsvReader {
+private:
+    ifstream in;
+    vector<char> buffer;
+    size_t begin = 0, end = 0, consumed = 0;
+    bool opened, exhausted = false;
+public:
+    explicit CsvReader(const string &filename, size_t blockSize = 1 << 20)
+      : in(filename, ios::binary), buffer(blockSize), opened(static_cast<bool>(in)) {}
+    bool isOpen() const { return opened; }
+    size_t bytesRead() const { return consumed; }
+    bool nextLine(string_view &line) {
+        size_t scanned = 0;    // bytes of this line already searched
+        bool quoted = false;   // a quoted field is open at scanned
+        while(true) {
+            const char* start = buffer.data() + begin;
+            const char* stop = buffer.data() + end;
+            const char* p = start + scanned;
+            const char* nl = nullptr;
+            while(p < stop) {
+                if(quoted) {
+                    const char* q = static_cast<const char*>(memchr(p, '"', stop - p));
+                    // A quote at the end of the buffer may be the first
+                    // of a doubled one; look again once more is read.
+                    if(!q || (q + 1 == stop && !exhausted)) {
+                        p = q ? q : stop;
+                        break;
+                    }
+                    if(q + 1 < stop && q[1] == '"') {
+                        p = q + 2;
+                    } else {
+                        quoted = false;
+                        p = q + 1;
+                    }
+                    continue;
+                }
+                const char* n = static_cast<const char*>(memchr(p, '\n', stop - p));
+                const char* limit = n ? n : stop;
+                const char* q = p;
+                while((q = static_cast<const char*>(memchr(q, '"', limit - q))) && q != start && q[-1] != ',')
+                    ++q;
+                if(!q) {
+                    nl = n;
+                    p = limit;
+                    break;
+                }
+                quoted = true;
+                p = q + 1;
+            }
+            if(nl || (exhausted && begin < end)) {
+                size_t len = nl ? nl - start : end - begin;
+                line = string_view(start, len);
+                begin += nl ? len + 1 : len;
+                if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+                return true;
+            }
+            if(exhausted) return false;
+            scanned = p - start;
+            memmove(buffer.data(), start, end - begin);
+            end -= begin;
+            begin = 0;
+            if(end == buffer.size()) buffer.resize(buffer.size() * 2);
+            in.read(buffer.data() + end, buffer.size() - end);
+            size_t got = static_cast<size_t>(in.gcount());
+            end += got;
+            consumed += got;
+            if(got == 0) exhausted = true;
+        }
+    }
+};
+
+// Books live in a chunked pool and are referred to by their slot, which
+// stays valid however large the catalog grows.
+typedef size_t BookHandle;
+const BookHandle noBook = static_cast<BookHandle>(-1);
+
+struct IssuedRecord {
+    string userID;    
+    BookHandle book;       
+    time_t issueTime;  
+};
+
+enum class BookStatus : uint8_t { Available, Borrowed, Reserved };
+
+const char* statusName(BookStatus s) {
+    switch(s) {
+        case BookStatus::Borrowed: return "Borrowed";
+        case BookStatus::Reserved: return "Reserved";
+        default: return "Available";
+    }
+}
+
+bool parseStatus(string_view text, BookStatus &s) {
+    if(text == "Available") s = BookStatus::Available;
+    else if(text == "Borrowed") s = BookStatus::Borrowed;
+    else if(text == "Reserved") s = BookStatus::Reserved;
+    else return false;
+    return true;
+}
+
+// allowedTransition[from][to]. A reservation hold is only placed when a
+// borrowed copy comes back, and a borrowed copy cannot be issued again.
+const bool allowedTransition[3][3] = {
+    //               Available  Borrowed  Reserved
+    /* Available */ { true,      true,     false },
+    /* Borrowed  */ { true,      false,    true  },
+    /* Reserved  */ { true,      true,     true  },
+};
+
+// Bump allocator for objects and text that are built in bulk and freed
+// together, such as the catalog read at startup. Nothing is freed on its
+// own; clear() returns every chunk at once. Not thread-safe.
+class Arena {
+private:
+    static constexpr size_t chunkSize = 1 << 20;
+    vector<unique_ptr<char[]>> chunks;
+    map<const char*, const char*> extents;   // chunk start -> end, for owns()
+    char* next = nullptr;
+    size_t left = 0;
+public:
+    void* allocate(size_t bytes, size_t align) {
+        size_t pad = (align - reinterpret_cast<uintptr_t>(next) % align) % align;
+        if(pad + bytes > left) {
+            size_t size = max(chunkSize, bytes + align);
+            chunks.push_back(make_unique<char[]>(size));
+            next = chunks.back().get();
+            extents.emplace(next, next + size);
+            left = size;
+            pad = (align - reinterpret_cast<uintptr_t>(next) % align) % align;
+        }
+        char* p = next + pad;
+        next = p + bytes;
+        left -= pad + bytes;
+        return p;
+    }
+    string_view copy(string_view text) {
+        if(text.empty()) return string_view();
+        char* p = static_cast<char*>(allocate(text.size(), 1));
+        memcpy(p, text.data(), text.size());
+        return string_view(p, text.size());
+    }
+    bool owns(const void* p) const {
+        const char* c = static_cast<const char*>(p);
+        auto after = extents.upper_bound(c);
+        return after != extents.begin() && c < prev(after)->second;
+    }
+    void clear() {
+        chunks.clear();
+        extents.clear();
+        next = nullptr;
+        left = 0;
+    }
+};
+
+// Author and publisher names repeat across thousands of titles, so books
+// keep a small id into this pool instead of their own copy of the text.
+// Books are built on any thread, so intern() takes a lock. get() needs
+// none: strings sit in fixed-size blocks that never move, found through a
+// table that never grows, and whoever holds an id got it after the
+// string was stored.
+class StringPool {
+private:
+    static const size_t blockBits = 12;
+    static const size_t blockSize = size_t(1) << blockBits;
+    // Enough blocks for every uint32_t id; unused entries stay null.
+    static const size_t maxBlocks = size_t(1) << (32 - blockBits);
+    array<unique_ptr<string[]>, maxBlocks> blocks;
+    size_t count = 0;
+    unordered_map<string_view, uint32_t> ids;
+    mutex lock;
+public:
+    StringPool() { intern(""); }
+    uint32_t intern(string_view text) {
+        lock_guard<mutex> guard(lock);
+        auto it = ids.find(text);
+        if(it != ids.end())
+            return it->second;
+        unique_ptr<string[]> &block = blocks[count >> blockBits];
+        if(!block)
+            block.reset(new string[blockSize]);
+        string &stored = block[count & (blockSize - 1)];
+        stored = text;
+        uint32_t id = static_cast<uint32_t>(count++);
+        ids.emplace(stored, id);
+        return id;
+    }
+    const string& get(uint32_t id) const { return blocks[id >> blockBits][id & (blockSize - 1)]; }
+};
+
+StringPool bookStrings;
+
+// Title and ISBN are views. A book built on its own owns the text they
+// view; a Library moves the text of the books it holds into its arena,
+// so a book copied out of a Library must not outlive it.
+class Book {
+private:
+    string_view title;
+    string_view isbn;
+    unique_ptr<char[]> ownText;   // null while the text is in an arena
+    vector<string> reservationQueue;   // FIFO of patron IDs; the front one holds the reservation
+    time_t reservationExpiry; 
+    uint32_t authorId;
+    uint32_t publisherId;
+    int32_t year;
+    BookStatus status;        
+    // Copies title and ISBN into arena, or into ownText without one.
+    void setText(string_view t, string_view i, Arena* arena) {
+        if(arena) {
+            title = arena->copy(t);
+            isbn = arena->copy(i);
+            ownText.reset();
+            return;
+        }
+        unique_ptr<char[]> text(new char[t.size() + i.size()]);
+        memcpy(text.get(), t.data(), t.size());
+        memcpy(text.get() + t.size(), i.data(), i.size());
+        title = string_view(text.get(), t.size());
+        isbn = string_view(text.get() + t.size(), i.size());
+        ownText = std::move(text);
+    }
+public:
+    Book() : reservationExpiry(0), authorId(0), publisherId(0), year(0), status(BookStatus::Available) {}
+    Book(const string &t, const string &a, const string &p, int y, const string &i)
+      : reservationExpiry(0), authorId(bookStrings.intern(a)), publisherId(bookStrings.intern(p)), year(y),
+        status(BookStatus::Available) {
+        setText(t, i, nullptr);
+    }
+    // Restores a stored book as-is, without going through the transition table.
+    Book(string_view t, string_view a, string_view p, int y, string_view i,
+         BookStatus s, string_view rby, time_t resExp, Arena* text = nullptr)
+      : reservationExpiry(resExp), authorId(bookStrings.intern(a)), publisherId(bookStrings.intern(p)),
+        year(y), status(s) {
+        setText(t, i, text);
+        setReservationQueueText(rby);
+    }
+    Book(const Book &other) : Book() { *this = other; }
+    Book(Book&&) = default;
+    Book& operator=(Book&&) = default;
+    Book& operator=(const Book &other) {
+        if(this == &other) return *this;
+        if(other.ownText) {
+            setText(other.title, other.isbn, nullptr);
+        } else {
+            title = other.title;
+            isbn = other.isbn;
+            ownText.reset();
+        }
+        reservationQueue = other.reservationQueue;
+        reservationExpiry = other.reservationExpiry;
+        authorId = other.authorId;
+        publisherId = other.publisherId;
+        year = other.year;
+        status = other.status;
+        return *this;
+    }
+    // Called by a Library when it takes the book in.
+    void moveTextInto(Arena &arena) { setText(title, isbn, &arena); }
+    string_view getTitle() const { return title; }
+    const string& getAuthor() const { return bookStrings.get(authorId); }
+    const string& getPublisher() const { return bookStrings.get(publisherId); }
+    uint32_t getAuthorId() const { return authorId; }
+    uint32_t getPublisherId() const { return publisherId; }
+    int getYear() const { return year; }
+    string_view getISBN() const { return isbn; }
+    BookStatus getStatus() const { return status; }
+    bool setStatus(BookStatus s) {
+        if(!allowedTransition[static_cast<int>(status)][static_cast<int>(s)])
+            return false;
+        status = s;
+        return true;
+    }
+    const string& getReservedBy() const {
+        static const string nobody;
+        return reservationQueue.empty() ? nobody : reservationQueue.front();
+    }
+    bool hasReservation() const { return !reservationQueue.empty(); }
+    size_t getReservationQueueLength() const { return reservationQueue.size(); }
+    bool isInReservationQueue(const string &uid) const {
+        return find(reservationQueue.begin(), reservationQueue.end(), uid) != reservationQueue.end();
+    }
+    void enqueueReservation(const string &uid) { reservationQueue.push_back(uid); }
+    void popReservation() {
+        if(!reservationQueue.empty())
+            reservationQueue.erase(reservationQueue.begin());
+    }
+    // The queue is stored in the old single-patron reservedBy column as
+    // IDs separated by '|', so files with one reservation read unchanged.
+    string getReservationQueueText() const {
+        string text;
+        for(const string &uid : reservationQueue) {
+            if(!text.empty()) text += '|';
+            text += uid;
+        }
+        return text;
+    }
+    void setReservationQueueText(string_view text) {
+        reservationQueue.clear();
+        while(!text.empty()) {
+            size_t bar = text.find('|');
+            reservationQueue.emplace_back(text.substr(0, bar));
+            if(bar == string_view::npos) break;
+            text.remove_prefix(bar + 1);
+        }
+    }
+    time_t getReservationExpiry() const { return reservationExpiry; }
+    void setReservationExpiry(time_t t) { reservationExpiry = t; }
+    void format(string &out, const string &currentUserID, time_t now) const {
+        out += "Title     : "; out += title;
+        out += "\nAuthor    : "; out += getAuthor();
+        out += "\nPublisher : "; out += getPublisher();
+        out += "\nYear      : "; out += to_string(year);
+        out += "\nISBN      : "; out += isbn;
+        out += "\n";
+        if (status == BookStatus::Reserved) {
+            if (currentUserID == getReservedBy() && now <= reservationExpiry)
+                out += "Status    : Available (Reserved exclusively for you)\n";
+            else
+                out += "Status    : Reserved\n";
+        } else {
+            out += "Status    : "; out += statusName(status); out += "\n";
+        }
+        out += "---------------------\n";
+    }
+    void display(const string &currentUserID = "") const {
+        string out;
+        format(out, currentUserID, time(0));
+        cout << out;
+    }
+    void toJSON(string &out) const {
+        out += "{\"title\":"; out += jsonString(title);
+        out += ",\"author\":"; out += jsonString(getAuthor());
+        out += ",\"publisher\":"; out += jsonString(getPublisher());
+        out += ",\"year\":"; out += to_string(year);
+        out += ",\"isbn\":"; out += jsonString(isbn);
+        out += ",\"status\":\""; out += statusName(status);
+        out += "\",\"reservationQueue\":[";
+        for(size_t i = 0; i < reservationQueue.size(); ++i) {
+            if(i) out += ',';
+            out += jsonString(reservationQueue[i]);
+        }
+        out += "]";
+        out += ",\"reservationExpiry\":"; out += to_string(reservationExpiry);
+        out += "}\n";
+    }
+
+    string toCSV() const {
+        string out = csvField(title);
+        out += ','; out += csvField(getAuthor());
+        out += ','; out += csvField(getPublisher());
+        out += ','; out += to_string(year);
+        out += ','; out += csvField(isbn);
+        out += ','; out += statusName(status);
+        out += ','; out += csvField(getReservationQueueText());
+        out += ','; out += to_string(reservationExpiry);
+        return out;
+    }
+    // Loaded rows are taken as-is; the transition table only guards
+    // changes made by circulation.
+    static bool fromFields(const CsvRow &row, Book &book, Arena* text = nullptr) {
+        if(row.size() < 5 || !parseNumber(row[3], book.year))
+            return false;
+        time_t expiry = 0;
+        if(!row[7].empty() && !parseNumber(row[7], expiry))
+            return false;
+        BookStatus s = BookStatus::Available;
+        if(!row[5].empty() && !parseStatus(row[5], s))
+            return false;
+        book.setText(row[0], row[4], text);
+        book.authorId = bookStrings.intern(row[1]);
+        book.publisherId = bookStrings.intern(row[2]);
+        book.status = s;
+        book.setReservationQueueText(row[6]);
+        book.reservationExpiry = expiry;
+        return true;
+    }
+    static bool fromCSV(string_view line, Book &book) {
+        CsvRow row;
+        return row.parse(line) && fromFields(row, book);
+    }
+};
+
+class Account {
+private:
+    vector<BookHandle> currentlyBorrowed;
+    double fineAmount;
+    double accruedFine;   // building up on overdue open loans; charged on return
+    bool fineSettlementPending; 
+public:
+    Account() : fineAmount(0.0), accruedFine(0.0), fineSettlementPending(false) {}
+    void addBorrowedBook(BookHandle book) { currentlyBorrowed.push_back(book); }
+    void clearBorrowedBooks() { currentlyBorrowed.clear(); }
+    void removeBorrowedBook(BookHandle book) {
+        auto it = find(currentlyBorrowed.begin(), currentlyBorrowed.end(), book);
+        if (it != currentlyBorrowed.end())
+            currentlyBorrowed.erase(it);
+    }
+    void addFine(double fine) { fineAmount += fine; }
+    void clearFine() { fineAmount = 0.0; }
+    double getFine() const { return fineAmount; }
+    double getAccruedFine() const { return accruedFine; }
+    void setAccruedFine(double fine) { accruedFine = fine; }
+    size_t getBorrowedCount() const { return currentlyBorrowed.size(); }
+    const vector<BookHandle>& getBorrowedBooks() const { return currentlyBorrowed; }
+    bool isFineSettlementPending() const { return fineSettlementPending; }
+    void requestFineSettlement() { fineSettlementPending = true; }
+    void approveFineSettlement() { fineSettlementPending = false; clearFine(); }
+};
+
+// Borrowing rules of one role. The built-in table reproduces the original
+// Student, Faculty and Librarian rules; policy.csv may change them or add
+// roles such as Staff or Alumni, which need no code of their own.
+struct BorrowingPolicy {
+    string role;
+    int maxBooks = 0;               // 0: may not borrow at all
+    int loanDays = 0;
+    double finePerDay = 0;          // for each day late beyond graceDays
+    int graceDays = 0;
+    int holdDays = 5;               // how long a returned book is held for this patron
+    bool clearanceBlocks = false;   // a pending fine clearance also blocks borrowing
+    bool librarian = false;         // librarian menu and fine approvals
+};
+
+typedef uint8_t RoleId;
+
+// Users refer to their role by index, which stays fixed once assigned;
+// files store the role name. The table is reserved for its maximum size
+// up front, so a role added at load time never moves the others.
+class PolicyTable {
+private:
+    vector<BorrowingPolicy> roles;
+public:
+    static const size_t maxRoles = 256;
+    PolicyTable() {
+        roles.reserve(maxRoles);
+        roles.push_back(BorrowingPolicy { "Student", 3, 15, 10, 0, 5, true, false });
+        roles.push_back(BorrowingPolicy { "Faculty", 5, 30, 0, 0, 5, false, false });
+        roles.push_back(BorrowingPolicy { "Librarian", 0, 0, 0, 0, 5, false, true });
+    }
+    const BorrowingPolicy& operator[](RoleId r) const { return roles[r]; }
+    size_t size() const { return roles.size(); }
+    bool find(string_view name, RoleId &r) const {
+        for(size_t i = 0; i < roles.size(); ++i)
+            if(roles[i].role == name) {
+                r = static_cast<RoleId>(i);
+                return true;
+            }
+        return false;
+    }
+    // Replaces the role of the same name or adds a new one.
+    bool set(const BorrowingPolicy &p) {
+        RoleId r;
+        if(find(p.role, r)) {
+            roles[r] = p;
+            return true;
+        }
+        if(roles.size() == maxRoles)
+            return false;
+        roles.push_back(p);
+        return true;
+    }
+    // A role found in the data but missing from the table is added with no
+    // borrowing rights, so its users are kept and saved unchanged.
+    bool findOrAdd(string_view name, RoleId &r) {
+        if(find(name, r))
+            return true;
+        BorrowingPolicy p;
+        p.role = string(name);
+        return !name.empty() && set(p) && find(name, r);
+    }
+    RoleId named(string_view name) {
+        RoleId r = 0;
+        findOrAdd(name, r);
+        return r;
+    }
+};
+
+PolicyTable policies;
+
+bool parseFlag(string_view text, bool &flag) {
+    if(text == "yes") flag = true;
+    else if(text == "no") flag = false;
+    else return false;
+    return true;
+}
+
+// One row of policy.csv:
+//   role,maxBooks,loanDays,finePerDay,graceDays,holdDays,clearanceBlocks,librarian
+bool policyFromFields(const CsvRow &row, BorrowingPolicy &p) {
+    if(row.size() < 8 || row[0].empty() || row[0] == "role")
+        return false;
+    p.role = string(row[0]);
+    return parseNumber(row[1], p.maxBooks) && parseNumber(row[2], p.loanDays) &&
+           parseNumber(row[3], p.finePerDay) && parseNumber(row[4], p.graceDays) &&
+           parseNumber(row[5], p.holdDays) && parseFlag(row[6], p.clearanceBlocks) &&
+           parseFlag(row[7], p.librarian) && p.maxBooks >= 0 && p.loanDays >= 0 &&
+           p.finePerDay >= 0 && p.graceDays >= 0 && p.holdDays >= 0;
+}
+
+const string& roleName(RoleId r) { return policies[r].role; }
+
+// Outcome of a circulation or account request, so callers other than the
+// menus can tell what happened.
+enum class OpStatus : uint8_t {
+    Ok, BookNotFound, UserNotFound, BookUnavailable, ReservedByOther, FineOutstanding,
+    LimitReached, NotPermitted, NotBorrowed, AlreadyBorrowed, AlreadyReserved, BookAvailable,
+    NoFine, SettlementPending, NoSettlementPending, DuplicateBook, DuplicateUser, HasLoans,
+    InvalidLogin
+};
+
+const char* opStatusName(OpStatus s) {
+    switch(s) {
+        case OpStatus::Ok: return "Ok";
+        case OpStatus::BookNotFound: return "BookNotFound";
+        case OpStatus::UserNotFound: return "UserNotFound";
+        case OpStatus::BookUnavailable: return "BookUnavailable";
+        case OpStatus::ReservedByOther: return "ReservedByOther";
+        case OpStatus::FineOutstanding: return "FineOutstanding";
+        case OpStatus::LimitReached: return "LimitReached";
+        case OpStatus::NotPermitted: return "NotPermitted";
+        case OpStatus::NotBorrowed: return "NotBorrowed";
+        case OpStatus::AlreadyBorrowed: return "AlreadyBorrowed";
+        case OpStatus::AlreadyReserved: return "AlreadyReserved";
+        case OpStatus::BookAvailable: return "BookAvailable";
+        case OpStatus::NoFine: return "NoFine";
+        case OpStatus::SettlementPending: return "SettlementPending";
+        case OpStatus::NoSettlementPending: return "NoSettlementPending";
+        case OpStatus::DuplicateBook: return "DuplicateBook";
+        case OpStatus::DuplicateUser: return "DuplicateUser";
+        case OpStatus::HasLoans: return "HasLoans";
+        case OpStatus::InvalidLogin: return "InvalidLogin";
+    }
+    return "Unknown";
+}
+
+// Console text for a failed request.
+const char* opStatusMessage(OpStatus s) {
+    switch(s) {
+        case OpStatus::BookNotFound: return "Book not found.";
+        case OpStatus::UserNotFound: return "User not found.";
+        case OpStatus::BookUnavailable: return "Book is already issued.";
+        case OpStatus::ReservedByOther: return "Book is reserved by another user.";
+        case OpStatus::FineOutstanding: return "Outstanding fine exists. Clear fines before borrowing.";
+        case OpStatus::LimitReached: return "You have reached your borrowing limit.";
+        case OpStatus::NotPermitted: return "Your account cannot borrow books.";
+        case OpStatus::NotBorrowed: return "You have not borrowed this book.";
+        case OpStatus::AlreadyBorrowed: return "You have already borrowed this book.";
+        case OpStatus::AlreadyReserved: return "You have already reserved this book.";
+        case OpStatus::BookAvailable: return "Book is available; you may borrow it.";
+        case OpStatus::NoFine: return "No fine to clear.";
+        case OpStatus::SettlementPending: return "Your fine clearance request is pending approval.";
+        case OpStatus::NoSettlementPending: return "No pending fine clearance for this user.";
+        case OpStatus::DuplicateBook: return "A book with this ISBN already exists. Not added.";
+        case OpStatus::DuplicateUser: return "A user with this ID already exists. Not added.";
+        case OpStatus::HasLoans: return "Cannot remove a user who has borrowed books.";
+        case OpStatus::InvalidLogin: return "Invalid password.";
+        default: return "Done.";
+    }
+}
+
+
+// Passwords are stored as "pbkdf2-sha256$<iterations>$<salt>$<hash>"
+// with the salt and hash in hex (PBKDF2-HMAC-SHA256, RFC 8018). Files
+// written by older versions hold plain passwords; those still log in
+// and are replaced by a hash at the first successful login.
+class Sha256 {
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t used = 0;
+    uint64_t length = 0;
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+    static void round(uint32_t a, uint32_t b, uint32_t c, uint32_t &d,
+                      uint32_t e, uint32_t f, uint32_t g, uint32_t &h, uint32_t kw) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kw;
+        d += t1;
+        h = t1 + (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    }
+    void compress(const unsigned char* p) {
+        uint32_t words[16];
+        for(int i = 0; i < 16; ++i)
+            words[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 | p[4 * i + 3];
+        compress(state, words);
+    }
+public:
+    static const size_t digestSize = 32;
+    // One block, already in big-endian words, into state.
+    static void compress(uint32_t state[8], const uint32_t block[16]) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+        uint32_t w[64];
+        memcpy(w, block, 16 * sizeof(uint32_t));
+        for(int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        // Eight rounds per pass with the roles of a to h rotated through
+        // the arguments, so no round copies the working variables.
+        for(int i = 0; i < 64; i += 8) {
+            round(a, b, c, d, e, f, g, h, k[i] + w[i]);
+            round(h, a, b, c, d, e, f, g, k[i + 1] + w[i + 1]);
+            round(g, h, a, b, c, d, e, f, k[i + 2] + w[i + 2]);
+            round(f, g, h, a, b, c, d, e, k[i + 3] + w[i + 3]);
+            round(e, f, g, h, a, b, c, d, k[i + 4] + w[i + 4]);
+            round(d, e, f, g, h, a, b, c, k[i + 5] + w[i + 5]);
+            round(c, d, e, f, g, h, a, b, k[i + 6] + w[i + 6]);
+            round(b, c, d, e, f, g, h, a, k[i + 7] + w[i + 7]);
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+    Sha256() {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        memcpy(state, initial, sizeof(state));
+    }
+    void update(const void* data, size_t n) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        length += n;
+        if(used > 0) {
+            size_t take = min(n, sizeof(block) - used);
+            memcpy(block + used, p, take);
+            used += take; p += take; n -= take;
+            if(used < sizeof(block)) return;
+            compress(block);
+            used = 0;
+        }
+        for(; n >= sizeof(block); p += sizeof(block), n -= sizeof(block))
+            compress(p);
+        memcpy(block, p, n);
+        used = n;
+    }
+    // The chaining state, meaningful after whole blocks only.
+    const uint32_t* midstate() const { return state; }
+    void finish(unsigned char out[digestSize]) {
+        uint64_t bits = length * 8;
+        unsigned char pad[72] = { 0x80 };
+        size_t padLength = (used < 56 ? 56 : 120) - used;
+        for(int i = 0; i < 8; ++i)
+            pad[padLength + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        update(pad, padLength + 8);
+        for(int i = 0; i < 8; ++i) {
+            out[4 * i] = static_cast<unsigned char>(state[i] >> 24);
+            out[4 * i + 1] = static_cast<unsigned char>(state[i] >> 16);
+            out[4 * i + 2] = static_cast<unsigned char>(state[i] >> 8);
+            out[4 * i + 3] = static_cast<unsigned char>(state[i]);
+        }
+    }
+};
+
+// One 32-byte block of PBKDF2-HMAC-SHA256. The HMAC key pads are hashed
+// once; after the first round every message is a 32-byte digest that
+// fits one padded block, so a round is just two compressions on words
+// with no byte conversion or padding.
+void pbkdf2Sha256(string_view password, string_view salt, uint32_t iterations,
+                  unsigned char out[Sha256::digestSize]) {
+    unsigned char key[64] = {};
+    if(password.size() > sizeof(key)) {
+        Sha256 h;
+        h.update(password.data(), password.size());
+        h.finish(key);
+    } else {
+        memcpy(key, password.data(), password.size());
+    }
+    unsigned char ipad[64], opad[64];
+    for(int i = 0; i < 64; ++i) {
+        ipad[i] = key[i] ^ 0x36;
+        opad[i] = key[i] ^ 0x5c;
+    }
+    Sha256 inner, outer;
+    inner.update(ipad, sizeof(ipad));
+    outer.update(opad, sizeof(opad));
+    unsigned char u[Sha256::digestSize];
+    const unsigned char blockIndex[4] = { 0, 0, 0, 1 };
+    Sha256 h = inner;
+    h.update(salt.data(), salt.size());
+    h.update(blockIndex, sizeof(blockIndex));
+    h.finish(u);
+    h = outer;
+    h.update(u, sizeof(u));
+    h.finish(u);
+    // block holds the previous digest followed by the padding for a
+    // 96-byte message (one key pad block and the digest).
+    uint32_t block[16] = {}, sum[8], state[8];
+    for(int i = 0; i < 8; ++i)
+        block[i] = sum[i] = uint32_t(u[4 * i]) << 24 | uint32_t(u[4 * i + 1]) << 16 | uint32_t(u[4 * i + 2]) << 8 | u[4 * i + 3];
+    block[8] = 0x80000000;
+    block[15] = (64 + Sha256::digestSize) * 8;
+    for(uint32_t i = 1; i < iterations; ++i) {
+        memcpy(state, inner.midstate(), sizeof(state));
+        Sha256::compress(state, block);
+        memcpy(block, state, sizeof(state));
+        memcpy(state, outer.midstate(), sizeof(state));
+        Sha256::compress(state, block);
+        memcpy(block, state, sizeof(state));
+        for(int j = 0; j < 8; ++j)
+            sum[j] ^= state[j];
+    }
+    for(int i = 0; i < 8; ++i)
+        for(int j = 0; j < 4; ++j)
+            out[4 * i + j] = static_cast<unsigned char>(sum[i] >> (24 - 8 * j));
+}
+
+void randomBytes(unsigned char* out, size_t n) {
+    thread_local random_device source;
+    for(size_t i = 0; i < n; i += sizeof(unsigned int)) {
+        unsigned int r = source();
+        memcpy(out + i, &r, min(sizeof(r), n - i));
+    }
+}
+
+string toHex(const unsigned char* data, size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    string out(2 * n, '0');
+    for(size_t i = 0; i < n; ++i) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 15];
+    }
+    return out;
+}
+
+bool fromHex(string_view text, string &out) {
+    if(text.size() % 2) return false;
+    out.clear();
+    for(size_t i = 0; i < text.size(); i += 2) {
+        int value = 0;
+        for(size_t j = i; j < i + 2; ++j) {
+            char ch = text[j];
+            int digit = isdigit(static_cast<unsigned char>(ch)) ? ch - '0'
+                      : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+            if(digit < 0) return false;
+            value = value * 16 + digit;
+        }
+        out += static_cast<char>(value);
+    }
+    return true;
+}
+
+const string_view passwordScheme = "pbkdf2-sha256$";
+// Stored hashes above this cost are refused, so one login stays bounded
+// whatever the users file says.
+const uint32_t maxPasswordIterations = 10000000;
+
+// The cost of new hashes. LMS_PASSWORD_ITERATIONS tunes it; stored hashes
+// keep their own count and are rehashed when it changes.
+uint32_t passwordIterations() {
+    static const uint32_t iterations = [] {
+        uint32_t n = 100000;
+        const char* text = getenv("LMS_PASSWORD_ITERATIONS");
+        if(text && (!parseNumber(string_view(text), n) || n == 0 || n > maxPasswordIterations))
+            n = 100000;
+        return n;
+    }();
+    return iterations;
+}
+
+string hashPassword(string_view password) {
+    unsigned char salt[16], hash[Sha256::digestSize];
+    randomBytes(salt, sizeof(salt));
+    uint32_t iterations = passwordIterations();
+    pbkdf2Sha256(password, string_view(reinterpret_cast<char*>(salt), sizeof(salt)), iterations, hash);
+    return string(passwordScheme) + to_string(iterations) + "$" + toHex(salt, sizeof(salt))
+         + "$" + toHex(hash, sizeof(hash));
+}
+
+bool isPasswordHash(string_view stored) { return stored.substr(0, passwordScheme.size()) == passwordScheme; }
+
+// Compares without an early exit, so the time taken does not tell how
+// much of a guess was right.
+bool equalInConstantTime(string_view a, string_view b) {
+    unsigned char diff = a.size() != b.size();
+    for(size_t i = 0; i < a.size() && i < b.size(); ++i)
+        diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+    return diff == 0;
+}
+
+// needsRehash is set when a match is stored in plain text or at another
+// cost than passwordIterations().
+bool checkPassword(string_view stored, string_view password, bool &needsRehash) {
+    if(!isPasswordHash(stored)) {
+        needsRehash = true;
+        return equalInConstantTime(stored, password);
+    }
+    string_view fields = stored.substr(passwordScheme.size());
+    size_t a = fields.find('$'), b = a == string_view::npos ? a : fields.find('$', a + 1);
+    uint32_t iterations;
+    string salt, expected;
+    if(b == string_view::npos || !parseNumber(fields.substr(0, a), iterations)
+       || iterations == 0 || iterations > maxPasswordIterations
+       || !fromHex(fields.substr(a + 1, b - a - 1), salt) || !fromHex(fields.substr(b + 1), expected)
+       || expected.size() != Sha256::digestSize)
+        return false;
+    unsigned char hash[Sha256::digestSize];
+    pbkdf2Sha256(password, salt, iterations, hash);
+    needsRehash = iterations != passwordIterations();
+    return equalInConstantTime(string_view(reinterpret_cast<char*>(hash), sizeof(hash)), expected);
+}
+
+// Spends the time of one check, for logins to unknown users.
+void checkPasswordDummy(string_view password) {
+    static const string dummy = hashPassword("");
+    bool needsRehash;
+    checkPassword(dummy, password, needsRehash);
+}
+
+class User {
+private:
+    string id;
+    string name;
+    string password;
+    RoleId role;
+    Account account;
+public:
+    User() : role(0) {}
+    User(const string &uid, const string &uname, const string &pass, RoleId r)
+      : id(uid), name(uname), password(pass), role(r) {}
+    // The stored form: a hash from hashPassword, or plain text in files
+    // not yet migrated.
+    const string& getPassword() const { return password; }
+    void setPassword(const string &stored) { password = stored; }
+    // Takes the fields of a users row for the same ID. Loans and a pending
+    // fine clearance are not in the row and stay as they are.
+    void updateFrom(const User &row) {
+        name = row.name;
+        password = row.password;
+        role = row.role;
+        account.clearFine();
+        account.addFine(row.account.getFine());
+    }
+    const BorrowingPolicy& getPolicy() const { return policies[role]; }
+    // The checks are the role's borrowing rules; the caller records the loan.
+    OpStatus borrowBook(Book* book, BookHandle handle) {
+        const BorrowingPolicy &policy = getPolicy();
+        if(policy.maxBooks <= 0)
+            return OpStatus::NotPermitted;
+        if(account.getFine() > 0 || (policy.clearanceBlocks && account.isFineSettlementPending()))
+            return OpStatus::FineOutstanding;
+        if(account.getBorrowedCount() >= static_cast<size_t>(policy.maxBooks))
+            return OpStatus::LimitReached;
+        if(book->getStatus() == BookStatus::Available) {
+            book->setStatus(BookStatus::Borrowed);
+            account.addBorrowedBook(handle);
+            return OpStatus::Ok;
+        }
+        else if(book->getStatus() == BookStatus::Reserved) {
+            time_t now = time(0);
+            if(book->getReservedBy() == id && now <= book->getReservationExpiry()){
+                book->setStatus(BookStatus::Borrowed);
+                book->popReservation();
+                book->setReservationExpiry(0);
+                account.addBorrowedBook(handle);
+                return OpStatus::Ok;
+            }
+            return OpStatus::ReservedByOther;
+        }
+        return OpStatus::BookUnavailable;
+    }
+    // Returns the fine charged for the return.
+    double returnBook(Book*, BookHandle handle, int daysBorrowed) {
+        const BorrowingPolicy &policy = getPolicy();
+        account.removeBorrowedBook(handle);
+        int chargeable = daysBorrowed - policy.loanDays - policy.graceDays;
+        if(chargeable <= 0 || policy.finePerDay <= 0)
+            return 0;
+        double fine = chargeable * policy.finePerDay;
+        account.addFine(fine);
+        return fine;
+    }
+    const string& getID() const { return id; }
+    const string& getName() const { return name; }
+    RoleId getRole() const { return role; }
+    Account& getAccount() { return account; }
+    const Account& getAccount() const { return account; }
+    void format(string &out) const {
+        out += roleName(role); out += ": ";
+        out += "User ID: "; out += id;
+        out += ", Name: "; out += name;
+        out += ", Role: "; out += roleName(role);
+        out += ", Fine: "; out += formatAmount(account.getFine());
+        out += "\n";
+    }
+    void display() const {
+        string out;
+        format(out);
+        cout << out;
+    }
+    void toJSON(string &out) const {
+        out += "{\"id\":"; out += jsonString(id);
+        out += ",\"name\":"; out += jsonString(name);
+        out += ",\"role\":"; out += jsonString(roleName(role));
+        out += ",\"fine\":"; out += formatAmount(account.getFine());
+        out += ",\"fineSettlementPending\":"; out += account.isFineSettlementPending() ? "true" : "false";
+        out += "}\n";
+    }
+    string toCSV() const {
+        string out = csvField(id);
+        out += ','; out += csvField(name);
+        out += ','; out += csvField(password);
+        out += ','; out += csvField(roleName(role));
+        out += ','; out += formatAmount(account.getFine());
+        return out;
+    }
+};
+
+// Users placed in an arena are destroyed with ~User() instead of delete.
+User* makeUser(const string &uid, const string &uname, const string &upass, RoleId urole, Arena* arena = nullptr) {
+    if(!arena)
+        return new User(uid, uname, upass, urole);
+    return new (arena->allocate(sizeof(User), alignof(User))) User(uid, uname, upass, urole);
+}
+
+User* userFromFields(const CsvRow &row, Arena* arena = nullptr) {
+    double ufine = 0;
+    RoleId urole;
+    if(row.size() < 5 || !policies.findOrAdd(row[3], urole) || !parseNumber(row[4], ufine)) return nullptr;
+    User* u = makeUser(string(row[0]), string(row[1]), string(row[2]), urole, arena);
+    if(u)
+        u->getAccount().addFine(ufine);
+    return u;
+}
+
+// Binary snapshot layout (native byte order):
+//   SnapshotHeader | SnapSearchHeader | SnapBook[bookCount]
+//   | SnapUser[userCount] | SnapIssued[issuedCount] | SnapTerm[termCount]
+//   | SnapPosting[postingCount] | string heap
+// Strings are (offset, length) pairs into the heap and issued records
+// already point at book slots, so loading needs no parsing or lookups.
+// The terms are the catalog search vocabulary in sorted order, each with
+// its run of postings, so the search index is not rebuilt either.
+const char snapshotMagic[8] = { 'L', 'M', 'S', 'S', 'N', 'A', 'P', '\0' };
+const uint32_t snapshotVersion = 4;
+const uint32_t snapshotByteOrder = 0x01020304;
+// Version 2 stored the role as one byte in place of the role string.
+const char* const snapshotV2Roles[3] = { "Student", "Faculty", "Librarian" };
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t bookCount;
+    uint64_t userCount;
+    uint64_t issuedCount;
+    uint64_t heapSize;
+};
+// Versions before 4 have no search header, terms or postings.
+struct SnapSearchHeader {
+    uint64_t termCount;
+    uint64_t postingCount;
+};
+struct SnapString { uint32_t offset; uint32_t length; };
+struct SnapBook {
+    SnapString title, author, publisher, isbn, reservedBy;
+    int32_t year;
+    uint8_t status;
+    uint8_t reserved[3];
+    int64_t reservationExpiry;
+};
+struct SnapUser {
+    SnapString id, name, password, role;
+    double fine;
+};
+// Version 1 kept the book status as a string and had four spare bytes
+// after the year; its users have the same layout as version 3.
+struct SnapBookV1 {
+    SnapString title, author, publisher, isbn, status, reservedBy;
+    int32_t year;
+    int32_t reserved;
+    int64_t reservationExpiry;
+};
+struct SnapIssued {
+    SnapString userID;
+    uint64_t book;
+    int64_t issueTime;
+};
+struct SnapTerm {
+    SnapString term;
+    uint64_t first;
+    uint64_t count;
+};
+struct SnapPosting {
+    uint32_t book;
+    uint8_t fields;
+    uint8_t reserved[3];
+};
+
+class SnapshotWriter {
+private:
+    string heap;
+public:
+    SnapString add(string_view str) {
+        SnapString ref { static_cast<uint32_t>(heap.size()), static_cast<uint32_t>(str.size()) };
+        heap += str;
+        return ref;
+    }
+    const string& getHeap() const { return heap; }
+};
+
+// Read-only view of a whole file; memory-mapped where the platform allows.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+    vector<char> fallback;
+public:
+    MappedFile() : data(nullptr), length(0) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    bool open(const string &filename) {
+#ifndef _WIN32
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(p == MAP_FAILED) return false;
+        data = static_cast<const char*>(p);
+        length = st.st_size;
+        return true;
+#else
+        ifstream inFile(filename, ios::binary);
+        if(!inFile) return false;
+        fallback.assign(istreambuf_iterator<char>(inFile), istreambuf_iterator<char>());
+        data = fallback.data();
+        length = fallback.size();
+        return length > 0;
+#endif
+    }
+    const char* begin() const { return data; }
+    size_t size() const { return length; }
+    ~MappedFile() {
+#ifndef _WIN32
+        if(data) munmap(const_cast<char*>(data), length);
+#endif
+    }
+};
+
+// Replaces a file so that a crash leaves either the old contents or the
+// new, never a torn mix: the data goes to a temporary file that is synced
+// to disk and then renamed over the original, and the directory is synced
+// so the rename itself survives.
+#ifndef _WIN32
+// Writes all of contents to fd and syncs it to disk.
+bool writeAndSync(int fd, const string &contents) {
+    const char* p = contents.data();
+    size_t left = contents.size();
+    while(left > 0) {
+        ssize_t n = ::write(fd, p, left);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        p += n;
+        left -= n;
+    }
+    return ::fsync(fd) == 0;
+}
+
+void syncDirectoryOf(const string &filename) {
+    string directory = filesystem::path(filename).parent_path().string();
+    int dirFd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(dirFd >= 0) {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+}
+#endif
+
+bool replaceFile(const string &filename, const string &contents) {
+    string temp = filename + ".tmp";
+#ifndef _WIN32
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) return false;
+    bool written = writeAndSync(fd, contents);
+    written = ::close(fd) == 0 && written;
+    if(!written || ::rename(temp.c_str(), filename.c_str()) != 0) {
+        ::unlink(temp.c_str());
+        return false;
+    }
+    syncDirectoryOf(filename);
+    return true;
+#else
+    {
+        ofstream outFile(temp, ios::binary | ios::trunc);
+        outFile.write(contents.data(), contents.size());
+        outFile.close();
+        if(!outFile) {
+            remove(temp.c_str());
+            return false;
+        }
+    }
+    error_code error;
+    filesystem::rename(temp, filename, error);
+    return !error;
+#endif
+}
+
+// The journal file. append writes a batch of records and returns once
+// they are on disk; without POSIX it can only flush the stream.
+class JournalFile {
+private:
+#ifndef _WIN32
+    int fd = -1;
+#else
+    ofstream out;
+#endif
+public:
+    JournalFile() = default;
+    JournalFile(const JournalFile&) = delete;
+    JournalFile& operator=(const JournalFile&) = delete;
+    bool open(const string &filename, bool truncate) {
+        close();
+#ifndef _WIN32
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+        return fd >= 0;
+#else
+        out.open(filename, truncate ? ios::trunc : ios::app);
+        return out.is_open();
+#endif
+    }
+    bool isOpen() const {
+#ifndef _WIN32
+        return fd >= 0;
+#else
+        return out.is_open();
+#endif
+    }
+    bool append(const string &records) {
+#ifndef _WIN32
+        return fd >= 0 && writeAndSync(fd, records);
+#else
+        out << records;
+        out.flush();
+        return static_cast<bool>(out);
+#endif
+    }
+    void close() {
+#ifndef _WIN32
+        if(fd >= 0) ::close(fd);
+        fd = -1;
+#else
+        if(out.is_open()) out.close();
+#endif
+    }
+    ~JournalFile() { close(); }
+};
+
+// Cuts a file back to length bytes and appends contents there, so a
+// failed earlier write never leaves garbage between two good blocks.
+bool writeFileAt(const string &filename, uint64_t length, const string &contents) {
+#ifndef _WIN32
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) return false;
+    bool written = ::ftruncate(fd, static_cast<off_t>(length)) == 0
+                && ::lseek(fd, static_cast<off_t>(length), SEEK_SET) >= 0
+                && writeAndSync(fd, contents);
+    written = ::close(fd) == 0 && written;
+    if(written && length == 0)
+        syncDirectoryOf(filename);
+    return written;
+#else
+    {
+        ofstream create(filename, ios::binary | ios::app);
+    }
+    error_code error;
+    filesystem::resize_file(filename, length, error);
+    if(error) return false;
+    ofstream outFile(filename, ios::binary | ios::app);
+    outFile.write(contents.data(), contents.size());
+    outFile.close();
+    return static_cast<bool>(outFile);
+#endif
+}
+
+// One flag per on-disk segment, set by whoever changes a row in it and
+// cleared by the checkpoint that writes it. Segments are only ever added,
+// under structureLock held exclusively; marking needs no lock.
+class DirtySegments {
+    deque<atomic<bool>> flags;
+public:
+    explicit DirtySegments(size_t count = 0) { grow(count); }
+    size_t size() const { return flags.size(); }
+    void grow(size_t count) {
+        while(flags.size() < count)
+            flags.emplace_back(false);
+    }
+    void mark(size_t segment) { flags[segment].store(true, memory_order_relaxed); }
+    void markAll() {
+        for(atomic<bool> &flag : flags)
+            flag.store(true, memory_order_relaxed);
+    }
+    // Clears the flags and returns the segments that were set.
+    vector<size_t> take() {
+        vector<size_t> taken;
+        for(size_t s = 0; s < flags.size(); ++s)
+            if(flags[s].exchange(false, memory_order_relaxed))
+                taken.push_back(s);
+        return taken;
+    }
+};
+
+// Stable across runs and platforms, unlike std::hash, so a user stays in
+// the same segment file.
+uint32_t stableHash(string_view text) {
+    uint32_t h = 2166136261u;
+    for(unsigned char c : text) {
+        h ^= c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void putVarint(string &out, uint64_t value) {
+    while(value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool getVarint(const char* &p, const char* end, uint64_t &value) {
+    value = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*p++);
+        value |= uint64_t(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+uint64_t zigzag(int64_t value) { return (uint64_t(value) << 1) ^ uint64_t(value >> 63); }
+int64_t unzigzag(uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
+
+// Broken-down local time. localtime and ctime share one result buffer
+// between threads, so listings built on the desk and server threads go
+// through this.
+tm localTime(time_t t) {
+    tm local;
+#ifndef _WIN32
+    localtime_r(&t, &local);
+#else
+    localtime_s(&local, &t);
+#endif
+    return local;
+}
+
+// "YYYY-MM" of a time in UTC. The checkpointer thread calls this while
+// the desks run, so it uses the reentrant gmtime_r rather than gmtime and
+// its shared result buffer.
+string utcMonth(time_t t) {
+    tm utc;
+#ifndef _WIN32
+    gmtime_r(&t, &utc);
+#else
+    gmtime_s(&utc, &t);
+#endif
+    char buf[16];
+    strftime(buf, sizeof(buf), "%Y-%m", &utc);
+    return buf;
+}
+
+// One closed loan. Sequence numbers are handed out in the order loans are
+// returned and let replay tell which returns the archive already holds.
+struct LoanHistoryRecord {
+    uint64_t sequence = 0;
+    string userID;
+    string isbn;
+    time_t issueTime = 0;
+    time_t returnTime = 0;
+    double fine = 0;
+};
+
+// Loans overlapping [from, to], optionally for one book or one user.
+struct HistoryQuery {
+    string isbn, userID;   // empty matches any
+    time_t from = numeric_limits<time_t>::min();
+    time_t to = numeric_limits<time_t>::max();
+    bool matches(const LoanHistoryRecord &r) const {
+        return r.issueTime <= to && r.returnTime >= from
+            && (isbn.empty() || r.isbn == isbn) && (userID.empty() || r.userID == userID);
+    }
+};
+
+// Append-only archive of closed loans under history/, one segment file per
+// calendar month of return. Records are written in blocks of up to
+// blockRecords. A block stores its user IDs and ISBNs once in a dictionary,
+// then each record as varints: codes into the dictionary, the times as
+// deltas from the previous record and the fine in paise. That is about a
+// quarter of the CSV size. Each block header holds the block's issue and
+// return time ranges, and each segment the range of its blocks, so a
+// query only reads blocks that can overlap it. Within a block, an ISBN or
+// user missing from the dictionary skips the records entirely.
+class LoanHistory {
+    struct BlockHeader {
+        char magic[4];
+        uint32_t records;
+        uint32_t payloadBytes;
+        uint32_t checksum;   // stableHash of the payload
+        uint64_t firstSequence, lastSequence;
+        int64_t minIssue, maxIssue, minReturn, maxReturn;
+    };
+    struct BlockRef {
+        uint64_t offset;
+        BlockHeader header;
+    };
+    struct Segment {
+        uint64_t length = 0;
+        int64_t minIssue = numeric_limits<int64_t>::max();
+        int64_t maxReturn = numeric_limits<int64_t>::min();
+        vector<BlockRef> blocks;
+        void add(uint64_t offset, const BlockHeader &header) {
+            blocks.push_back(BlockRef { offset, header });
+            length = offset + sizeof(BlockHeader) + header.payloadBytes;
+            minIssue = min(minIssue, header.minIssue);
+            maxReturn = max(maxReturn, header.maxReturn);
+        }
+    };
+    static constexpr char blockMagic[4] = { 'L', 'H', 'B', '1' };
+    static const size_t blockRecords = 4096;
+    const string directory = "history";
+    // The index is read by queries and extended by the checkpointer.
+    mutable mutex indexLock;
+    map<string, Segment> segments;   // by path; the names sort by month
+    uint64_t lastArchived = 0;
+    static bool overlaps(int64_t minIssue, int64_t maxReturn, const HistoryQuery &query) {
+        return minIssue <= query.to && maxReturn >= query.from;
+    }
+    static string encodeBlock(const vector<LoanHistoryRecord> &records, size_t first, size_t last) {
+        BlockHeader header;
+        memcpy(header.magic, blockMagic, sizeof(header.magic));
+        header.records = static_cast<uint32_t>(last - first);
+        header.firstSequence = records[first].sequence;
+        header.lastSequence = records[last - 1].sequence;
+        header.minIssue = header.minReturn = numeric_limits<int64_t>::max();
+        header.maxIssue = header.maxReturn = numeric_limits<int64_t>::min();
+        unordered_map<string, uint64_t> codes;
+        vector<const string*> names;
+        auto code = [&](const string &name) {
+            auto entry = codes.emplace(name, names.size());
+            if(entry.second)
+                names.push_back(&entry.first->first);
+            return entry.first->second;
+        };
+        string rows;
+        int64_t issue = 0, returned = 0;
+        uint64_t sequence = header.firstSequence;
+        for(size_t i = first; i < last; ++i) {
+            const LoanHistoryRecord &r = records[i];
+            putVarint(rows, code(r.userID));
+            putVarint(rows, code(r.isbn));
+            putVarint(rows, zigzag(r.issueTime - issue));
+            putVarint(rows, zigzag(r.returnTime - returned));
+            putVarint(rows, static_cast<uint64_t>(llround(max(r.fine, 0.0) * 100)));
+            putVarint(rows, r.sequence - sequence);
+            issue = r.issueTime;
+            returned = r.returnTime;
+            sequence = r.sequence;
+            header.minIssue = min<int64_t>(header.minIssue, r.issueTime);
+            header.maxIssue = max<int64_t>(header.maxIssue, r.issueTime);
+            header.minReturn = min<int64_t>(header.minReturn, r.returnTime);
+            header.maxReturn = max<int64_t>(header.maxReturn, r.returnTime);
+        }
+        string payload;
+        putVarint(payload, names.size());
+        for(const string* name : names) {
+            putVarint(payload, name->size());
+            payload += *name;
+        }
+        payload += rows;
+        header.payloadBytes = static_cast<uint32_t>(payload.size());
+        header.checksum = stableHash(payload);
+        string block(reinterpret_cast<const char*>(&header), sizeof(header));
+        return block + payload;
+    }
+    // Appends the records of a block that match query to out; false if the
+    // payload is damaged.
+    static bool decodeBlock(const BlockHeader &header, const string &payload, const HistoryQuery &query,
+                            vector<LoanHistoryRecord> &out) {
+        const char* p = payload.data();
+        const char* end = p + payload.size();
+        uint64_t count, length;
+        if(!getVarint(p, end, count) || count > payload.size()) return false;
+        vector<string> names(count);
+        const uint64_t none = numeric_limits<uint64_t>::max();
+        uint64_t wantedUser = query.userID.empty() ? none : none - 1;
+        uint64_t wantedIsbn = query.isbn.empty() ? none : none - 1;
+        for(uint64_t c = 0; c < count; ++c) {
+            if(!getVarint(p, end, length) || length > uint64_t(end - p)) return false;
+            names[c].assign(p, length);
+            p += length;
+            if(wantedUser != none && names[c] == query.userID) wantedUser = c;
+            if(wantedIsbn != none && names[c] == query.isbn) wantedIsbn = c;
+        }
+        if(wantedUser == none - 1 || wantedIsbn == none - 1)
+            return true;
+        int64_t issue = 0, returned = 0;
+        uint64_t sequence = header.firstSequence;
+        for(uint32_t i = 0; i < header.records; ++i) {
+            uint64_t user, isbn, issueDelta, returnDelta, paise, sequenceDelta;
+            if(!getVarint(p, end, user) || !getVarint(p, end, isbn) || !getVarint(p, end, issueDelta)
+               || !getVarint(p, end, returnDelta) || !getVarint(p, end, paise) || !getVarint(p, end, sequenceDelta)
+               || user >= count || isbn >= count)
+                return false;
+            issue += unzigzag(issueDelta);
+            returned += unzigzag(returnDelta);
+            sequence += sequenceDelta;
+            if((wantedUser != none && user != wantedUser) || (wantedIsbn != none && isbn != wantedIsbn))
+                continue;
+            if(issue > query.to || returned < query.from)
+                continue;
+            out.push_back(LoanHistoryRecord { sequence, names[user], names[isbn], static_cast<time_t>(issue),
+                                              static_cast<time_t>(returned), paise / 100.0 });
+        }
+        return true;
+    }
+public:
+    uint64_t lastSequence() const {
+        lock_guard<mutex> lock(indexLock);
+        return lastArchived;
+    }
+    // Rebuilds the index from the block headers. Only the last block of a
+    // segment can be torn by a crash, so only its checksum is checked; a
+    // torn block is cut off. Returns how many were.
+    size_t load() {
+        lock_guard<mutex> lock(indexLock);
+        segments.clear();
+        lastArchived = 0;
+        size_t dropped = 0;
+        error_code error;
+        for(const auto &entry : filesystem::directory_iterator(directory, error)) {
+            if(entry.path().extension() != ".bin") continue;
+            string path = directory + "/" + entry.path().filename().string();
+            uint64_t size = filesystem::file_size(path, error);
+            if(error) continue;
+            ifstream in(path, ios::binary);
+            Segment segment;
+            uint64_t offset = 0;
+            BlockHeader header;
+            while(offset + sizeof(header) <= size) {
+                in.seekg(offset);
+                if(!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+                   || memcmp(header.magic, blockMagic, sizeof(header.magic)) != 0
+                   || offset + sizeof(header) + header.payloadBytes > size)
+                    break;
+                if(offset + sizeof(header) + header.payloadBytes == size) {
+                    string payload(header.payloadBytes, '\0');
+                    if(!in.read(&payload[0], payload.size()) || stableHash(payload) != header.checksum)
+                        break;
+                }
+                segment.add(offset, header);
+                lastArchived = max(lastArchived, header.lastSequence);
+                offset = segment.length;
+            }
+            if(offset < size) {
+                in.close();
+                filesystem::resize_file(path, offset, error);
+                ++dropped;
+            }
+            if(!segment.blocks.empty())
+                segments[path] = std::move(segment);
+        }
+        return dropped;
+    }
+    // Writes records, which are in sequence order, as blocks. Returns how
+    // many are on disk; the rest must be offered again later.
+    size_t append(const vector<LoanHistoryRecord> &records) {
+        if(records.empty()) return 0;
+        error_code error;
+        filesystem::create_directories(directory, error);
+        size_t done = 0;
+        while(done < records.size()) {
+            string month = utcMonth(records[done].returnTime);
+            size_t end = done + 1;
+            while(end < records.size() && end - done < blockRecords && utcMonth(records[end].returnTime) == month)
+                ++end;
+            string block = encodeBlock(records, done, end);
+            string path = directory + "/loans-" + month + ".bin";
+            uint64_t offset;
+            {
+                lock_guard<mutex> lock(indexLock);
+                offset = segments[path].length;
+            }
+            METRIC_TIMER(timer, SaveHistory);
+            METRIC_BYTES(timer, block.size());
+            bool written = writeFileAt(path, offset, block);
+            METRIC_OUTCOME(timer, written);
+            if(!written) break;
+            BlockHeader header;
+            memcpy(&header, block.data(), sizeof(header));
+            lock_guard<mutex> lock(indexLock);
+            segments[path].add(offset, header);
+            lastArchived = max(lastArchived, header.lastSequence);
+            done = end;
+        }
+        return done;
+    }
+    // Archived loans matching query, oldest segment first. covered is set
+    // to the last sequence number the search could see, so a caller can
+    // add newer records that are not on disk yet without repeating any.
+    // unreadable is set to the number of blocks that could not be read or
+    // decoded; their records are left out.
+    vector<LoanHistoryRecord> find(const HistoryQuery &query, uint64_t &covered, size_t &unreadable) const {
+        unreadable = 0;
+        vector<pair<string, BlockRef>> candidates;
+        {
+            lock_guard<mutex> lock(indexLock);
+            covered = lastArchived;
+            for(const auto &segment : segments) {
+                if(!overlaps(segment.second.minIssue, segment.second.maxReturn, query)) continue;
+                for(const BlockRef &block : segment.second.blocks)
+                    if(overlaps(block.header.minIssue, block.header.maxReturn, query))
+                        candidates.emplace_back(segment.first, block);
+            }
+        }
+        vector<LoanHistoryRecord> found;
+        ifstream in;
+        string openPath, payload;
+        for(const auto &candidate : candidates) {
+            if(candidate.first != openPath) {
+                in.close();
+                in.clear();
+                in.open(candidate.first, ios::binary);
+                openPath = candidate.first;
+            }
+            const BlockHeader &header = candidate.second.header;
+            payload.resize(header.payloadBytes);
+            in.seekg(candidate.second.offset + sizeof(header));
+            size_t before = found.size();
+            if(!in.read(&payload[0], payload.size()) || stableHash(payload) != header.checksum
+               || !decodeBlock(header, payload, query, found)) {
+                found.erase(found.begin() + before, found.end());
+                in.clear();
+                ++unreadable;
+            }
+        }
+        return found;
+    }
+};
+
+// Inverted index over the words of each book's title, author and publisher.
+// The vocabulary is kept sorted so a query word also matches every term it
+// is a prefix of; a word with no exact or prefix match falls back to terms
+// within one edit that share its first letter.
+class CatalogSearch {
+public:
+    struct Results {
+        vector<BookHandle> hits;
+        size_t total = 0;
+    };
+    struct Posting {
+        BookHandle book;
+        uint8_t fields;
+    };
+private:
+    enum Field : uint8_t { PublisherField = 1, AuthorField = 2, TitleField = 4 };
+    struct Score {
+        unsigned matched = 0;
+        unsigned points = 0;
+    };
+    typedef unordered_map<string, vector<Posting>> TermMap;
+    TermMap terms;
+    // Sorted view of the vocabulary for prefix and fuzzy lookups; rebuilt
+    // lazily on the first search after new terms appear.
+    mutable vector<const TermMap::value_type *> vocabulary;
+    mutable bool vocabularySorted = true;
+    mutable mutex vocabularyLock;   // concurrent searches may race to sort
+    string scratch;
+
+    static void tokenize(string_view text, vector<string> &words) {
+        string word;
+        for(char c : text) {
+            unsigned char uc = static_cast<unsigned char>(c);
+            if(isalnum(uc)) {
+                word += static_cast<char>(tolower(uc));
+            } else if(!word.empty()) {
+                words.push_back(word);
+                word.clear();
+            }
+        }
+        if(!word.empty())
+            words.push_back(word);
+    }
+    static unsigned fieldWeight(uint8_t fields) {
+        if(fields & TitleField) return 3;
+        if(fields & AuthorField) return 2;
+        return 1;
+    }
+    static bool withinOneEdit(const string &a, const string &b) {
+        if(a.size() > b.size()) return withinOneEdit(b, a);
+        if(b.size() - a.size() > 1) return false;
+        size_t i = 0;
+        while(i < a.size() && a[i] == b[i]) ++i;
+        if(a.size() == b.size())
+            return i == a.size() || a.compare(i + 1, string::npos, b, i + 1, string::npos) == 0;
+        return a.compare(i, string::npos, b, i + 1, string::npos) == 0;
+    }
+    void addTerm(BookHandle h, const string &word, uint8_t field) {
+        auto found = terms.find(word);
+        if(found == terms.end()) {
+            found = terms.emplace(word, vector<Posting>()).first;
+            vocabulary.push_back(&*found);
+            vocabularySorted = false;
+        }
+        vector<Posting> &list = found->second;
+        if(!list.empty() && list.back().book == h)
+            list.back().fields |= field;
+        else
+            list.push_back(Posting { h, field });
+    }
+    void addWords(BookHandle h, string_view text, uint8_t field) {
+        string &word = scratch;
+        word.clear();
+        for(char c : text) {
+            unsigned char uc = static_cast<unsigned char>(c);
+            if(isalnum(uc)) {
+                word += static_cast<char>(tolower(uc));
+            } else if(!word.empty()) {
+                addTerm(h, word, field);
+                word.clear();
+            }
+        }
+        if(!word.empty())
+            addTerm(h, word, field);
+    }
+    void sortVocabulary() const {
+        lock_guard<mutex> lock(vocabularyLock);
+        if(vocabularySorted) return;
+        sort(vocabulary.begin(), vocabulary.end(),
+            [](const TermMap::value_type *a, const TermMap::value_type *b) { return a->first < b->first; });
+        vocabularySorted = true;
+    }
+    // First vocabulary entry not less than key.
+    size_t lowerBound(const string &key) const {
+        return lower_bound(vocabulary.begin(), vocabulary.end(), key,
+            [](const TermMap::value_type *e, const string &k) { return e->first < k; }) - vocabulary.begin();
+    }
+public:
+    void clear() {
+        terms.clear();
+        vocabulary.clear();
+        vocabularySorted = true;
+    }
+    // Books must be added in handle order so each posting list stays sorted.
+    void add(BookHandle h, const Book &b) {
+        addWords(h, b.getTitle(), TitleField);
+        addWords(h, b.getAuthor(), AuthorField);
+        addWords(h, b.getPublisher(), PublisherField);
+    }
+    // The vocabulary in sorted order with each term's postings, for the
+    // snapshot.
+    template<class Visit> void forEachTerm(Visit visit) const {
+        sortVocabulary();
+        for(const TermMap::value_type *e : vocabulary)
+            visit(e->first, e->second);
+    }
+    void reserve(size_t termCount) { terms.reserve(termCount); }
+    // Puts back a term saved by forEachTerm. Terms must come in sorted
+    // order, which keeps the vocabulary sorted; false for one that does not.
+    bool restoreTerm(string_view term, vector<Posting> list) {
+        if(!vocabulary.empty() && vocabulary.back()->first >= term) return false;
+        vocabulary.push_back(&*terms.emplace(string(term), std::move(list)).first);
+        return true;
+    }
+    // Ranks books by how many query words they match, then by match quality
+    // (exact > prefix > fuzzy) weighted by field (title > author > publisher).
+    Results search(const string &query, size_t offset, size_t limit) const {
+        vector<string> words;
+        tokenize(query, words);
+        sortVocabulary();
+        unordered_map<BookHandle, Score> scores;
+        for(const string &w : words) {
+            unordered_map<BookHandle, unsigned> best;
+            auto credit = [&](const vector<Posting> &list, unsigned quality) {
+                for(const Posting &p : list) {
+                    unsigned points = quality * fieldWeight(p.fields);
+                    unsigned &current = best[p.book];
+                    if(points > current) current = points;
+                }
+            };
+            bool found = false;
+            for(size_t i = lowerBound(w); i < vocabulary.size() && vocabulary[i]->first.compare(0, w.size(), w) == 0; ++i) {
+                credit(vocabulary[i]->second, vocabulary[i]->first.size() == w.size() ? 3 : 2);
+                found = true;
+            }
+            if(!found && w.size() >= 3) {
+                for(size_t i = lowerBound(w.substr(0, 1)); i < vocabulary.size() && vocabulary[i]->first[0] == w[0]; ++i)
+                    if(withinOneEdit(vocabulary[i]->first, w))
+                        credit(vocabulary[i]->second, 1);
+            }
+            for(const auto &kv : best) {
+                Score &sc = scores[kv.first];
+                ++sc.matched;
+                sc.points += kv.second;
+            }
+        }
+        vector<pair<BookHandle, Score>> ranked(scores.begin(), scores.end());
+        Results results;
+        results.total = ranked.size();
+        if(offset >= ranked.size())
+            return results;
+        size_t end = min(ranked.size(), offset + limit);
+        partial_sort(ranked.begin(), ranked.begin() + end, ranked.end(),
+            [](const pair<BookHandle, Score> &a, const pair<BookHandle, Score> &b) {
+                if(a.second.matched != b.second.matched) return a.second.matched > b.second.matched;
+                if(a.second.points != b.second.points) return a.second.points > b.second.points;
+                return a.first < b.first;
+            });
+        for(size_t i = offset; i < end; ++i)
+            results.hits.push_back(ranked[i].first);
+        return results;
+    }
+};
+
+struct BookFilter {
+    bool byStatus = false;
+    BookStatus status = BookStatus::Available;
+    int minYear = numeric_limits<int>::min();
+    int maxYear = numeric_limits<int>::max();
+    string author;   // case-insensitive substring; empty matches every author
+    bool matchesAuthor(const string &a) const {
+        return search(a.begin(), a.end(), author.begin(), author.end(), [](char x, char y) {
+            return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y));
+        }) != a.end();
+    }
+    bool matches(const Book &b) const {
+        if(byStatus && b.getStatus() != status) return false;
+        if(b.getYear() < minYear || b.getYear() > maxYear) return false;
+        return author.empty() || matchesAuthor(b.getAuthor());
+    }
+};
+
+struct OverdueLoan {
+    string userID;
+    BookHandle book;
+    time_t issueTime;
+    int daysOverdue;
+    double accruedFine;
+};
+
+struct OverdueSummary {
+    size_t openLoans = 0;
+    double totalAccrued = 0;
+    vector<OverdueLoan> overdue;
+};
+
+enum class OpKind : uint8_t { Issue, Return, Reserve };
+
+struct BatchOp {
+    OpKind kind;
+    string userID;
+    string isbn;
+    int daysBorrowed = 0;   // returns only
+};
+
+struct OpResult {
+    OpStatus status = OpStatus::Ok;
+    double fine = 0;            // fine charged by a return
+    string heldFor;             // patron a returned book is now held for
+    size_t queuePosition = 0;   // place in the queue after a reservation
+    int holdDays = 0;           // length of that hold, or of the one the reservation will get
+};
+
+enum class ReportKind : uint8_t { LoansByAuthor, UtilizationByYear, CollectionByPublisher };
+
+// A report is a small table: a label column followed by numeric ones.
+struct ReportRow {
+    string label;
+    vector<double> values;
+};
+
+struct Report {
+    vector<string> columns;
+    vector<ReportRow> rows;
+    bool complete = true;   // false if part of the loan history could not be read
+};
+
+// Loans as two parallel columns.
+struct LoanColumns {
+    vector<uint32_t> book;
+    vector<time_t> issueTime;
+};
+
+// The catalog column by column for reports: author and publisher as codes
+// into a dictionary of distinct names, year and status as plain integers.
+// Library keeps it in step with books, so a report scans a few flat arrays
+// with no strings or branches in the inner loops rather than every Book.
+// Set and setStatus follow the locking of the book row they mirror.
+class CatalogColumns {
+    // Column codes are dense per library; the *Codes vectors map a
+    // bookStrings id to its code, so encoding a row needs no hashing.
+    static constexpr uint32_t noCode = numeric_limits<uint32_t>::max();
+    vector<uint32_t> authorCodes, publisherCodes;
+    vector<string> authorNames, publisherNames;
+    vector<uint32_t> author, publisher;
+    vector<int16_t> year;
+    vector<uint8_t> status;
+    int16_t firstYear = numeric_limits<int16_t>::max(), lastYear = numeric_limits<int16_t>::min();
+    static uint32_t encode(uint32_t id, vector<uint32_t> &codes, vector<string> &names) {
+        if(id >= codes.size())
+            codes.resize(id + 1, noCode);
+        if(codes[id] == noCode) {
+            codes[id] = static_cast<uint32_t>(names.size());
+            names.push_back(bookStrings.get(id));
+        }
+        return codes[id];
+    }
+    static vector<ReportRow> sortedRows(vector<ReportRow> rows) {
+        stable_sort(rows.begin(), rows.end(), [](const ReportRow &a, const ReportRow &b) {
+            return a.values[0] > b.values[0];
+        });
+        return rows;
+    }
+public:
+    void clear() {
+        authorCodes.clear();
+        publisherCodes.clear();
+        authorNames.clear();
+        publisherNames.clear();
+        author.clear();
+        publisher.clear();
+        year.clear();
+        status.clear();
+        firstYear = numeric_limits<int16_t>::max();
+        lastYear = numeric_limits<int16_t>::min();
+    }
+    size_t size() const { return year.size(); }
+    // h is an existing row or the next one.
+    void set(BookHandle h, const Book &b) {
+        if(h == year.size()) {
+            author.push_back(0);
+            publisher.push_back(0);
+            year.push_back(0);
+            status.push_back(0);
+        }
+        author[h] = encode(b.getAuthorId(), authorCodes, authorNames);
+        publisher[h] = encode(b.getPublisherId(), publisherCodes, publisherNames);
+        year[h] = static_cast<int16_t>(clamp<int>(b.getYear(), numeric_limits<int16_t>::min(), numeric_limits<int16_t>::max()));
+        firstYear = min(firstYear, year[h]);
+        lastYear = max(lastYear, year[h]);
+        status[h] = static_cast<uint8_t>(b.getStatus());
+    }
+    void setStatus(BookHandle h, BookStatus s) { status[h] = static_cast<uint8_t>(s); }
+    const vector<uint8_t> &statuses() const { return status; }
+    // One byte per book, 1 where the book passes filter. statuses is a
+    // copy of the status column, which may be shorter than the others.
+    vector<uint8_t> select(const BookFilter &filter, const vector<uint8_t> &statuses) const {
+        size_t n = statuses.size();
+        vector<uint8_t> keep(n);
+        uint8_t* out = keep.data();
+        const int16_t* years = year.data();
+        const uint8_t* states = statuses.data();
+        int16_t lo = static_cast<int16_t>(clamp<int>(filter.minYear, numeric_limits<int16_t>::min(), numeric_limits<int16_t>::max()));
+        int16_t hi = static_cast<int16_t>(clamp<int>(filter.maxYear, numeric_limits<int16_t>::min(), numeric_limits<int16_t>::max()));
+        uint8_t anyStatus = !filter.byStatus, wanted = static_cast<uint8_t>(filter.status);
+        auto pass = [&](size_t i) -> uint8_t {
+            return (years[i] >= lo) & (years[i] <= hi) & (anyStatus | (states[i] == wanted));
+        };
+        // Fixed-size blocks through a local buffer: with no tail and no
+        // possible aliasing, g++ -O2 vectorizes the inner loop, which
+        // makes the scan about three times faster.
+        const size_t block = 32;
+        size_t i = 0;
+        for(; i + block <= n; i += block) {
+            uint8_t passed[block];
+            for(size_t j = 0; j < block; ++j)
+                passed[j] = pass(i + j);
+            memcpy(out + i, passed, block);
+        }
+        for(; i < n; ++i)
+            out[i] = pass(i);
+        if(!filter.author.empty()) {
+            vector<uint8_t> authorMatches(authorNames.size());
+            for(size_t code = 0; code < authorNames.size(); ++code)
+                authorMatches[code] = filter.matchesAuthor(authorNames[code]);
+            const uint8_t* matches = authorMatches.data();
+            const uint32_t* authors = author.data();
+            for(size_t h = 0; h < n; ++h)
+                out[h] &= matches[authors[h]];
+        }
+        return keep;
+    }
+    // Loans issued at or after since, open or returned, counted per author
+    // of the book.
+    Report loansByAuthor(const vector<uint8_t> &keep, const LoanColumns &loans, time_t since) const {
+        vector<uint64_t> counts(authorNames.size());
+        for(size_t i = 0; i < loans.book.size(); ++i) {
+            uint32_t b = loans.book[i];
+            counts[author[b]] += keep[b] & (loans.issueTime[i] >= since);
+        }
+        Report report;
+        report.columns = { "Author", "Loans" };
+        for(size_t code = 0; code < counts.size(); ++code)
+            if(counts[code] > 0)
+                report.rows.push_back(ReportRow { authorNames[code], { static_cast<double>(counts[code]) } });
+        report.rows = sortedRows(std::move(report.rows));
+        return report;
+    }
+    // Titles per publication year and how many are out, with the share out
+    // on loan or held as a percentage.
+    Report utilizationByYear(const vector<uint8_t> &keep, const vector<uint8_t> &statuses) const {
+        Report report;
+        report.columns = { "Year", "Titles", "On loan", "Reserved", "Utilization %" };
+        if(firstYear > lastYear)
+            return report;
+        // counts[y * 3 + status], with rows left out by the filter going
+        // to an extra bucket past the end.
+        int first = firstYear;
+        size_t span = static_cast<size_t>(lastYear - first) + 1;
+        vector<uint64_t> counts(span * 3 + 1);
+        for(size_t i = 0; i < keep.size(); ++i) {
+            size_t slot = static_cast<size_t>(year[i] - first) * 3 + statuses[i];
+            counts[keep[i] ? slot : span * 3]++;
+        }
+        for(size_t y = 0; y < span; ++y) {
+            uint64_t available = counts[y * 3], onLoan = counts[y * 3 + 1], reserved = counts[y * 3 + 2];
+            uint64_t titles = available + onLoan + reserved;
+            if(titles == 0) continue;
+            double utilization = 100.0 * (onLoan + reserved) / titles;
+            report.rows.push_back(ReportRow { to_string(first + static_cast<int>(y)),
+                { double(titles), double(onLoan), double(reserved), round(utilization * 10) / 10 } });
+        }
+        return report;
+    }
+    Report collectionByPublisher(const vector<uint8_t> &keep, const vector<uint8_t> &statuses) const {
+        vector<uint64_t> counts(publisherNames.size() * 3 + 1);
+        size_t skipped = publisherNames.size() * 3;
+        for(size_t i = 0; i < keep.size(); ++i)
+            counts[keep[i] ? publisher[i] * 3 + statuses[i] : skipped]++;
+        Report report;
+        report.columns = { "Publisher", "Titles", "Available", "On loan", "Reserved" };
+        for(size_t code = 0; code < publisherNames.size(); ++code) {
+            uint64_t available = counts[code * 3], onLoan = counts[code * 3 + 1], reserved = counts[code * 3 + 2];
+            uint64_t titles = available + onLoan + reserved;
+            if(titles > 0)
+                report.rows.push_back(ReportRow { publisherNames[code],
+                    { double(titles), double(available), double(onLoan), double(reserved) } });
+        }
+        report.rows = sortedRows(std::move(report.rows));
+        return report;
+    }
+};
+
+// Tokens handed out at login. A kiosk resumes its patron's session with
+// the token instead of sending the password again, which skips the key
+// derivation. Sessions live in memory only and lapse after sessionIdle
+// without use. The map is split into shards by token so concurrent
+// lookups rarely meet on a lock.
+class SessionCache {
+private:
+    typedef chrono::steady_clock Clock;
+    struct Session {
+        string userID;
+        Clock::time_point expiry;
+    };
+    struct Shard {
+        mutex lock;
+        unordered_map<string, Session> sessions;
+    };
+    static const size_t shardCount = 16;
+    static const size_t shardCapacity = 1 << 16;
+    array<Shard, shardCount> shards;
+    Shard& shardOf(const string &token) { return shards[hash<string>()(token) % shardCount]; }
+    // Makes room in a full shard: expired sessions go first, then the one
+    // closest to expiring.
+    static void evict(Shard &shard, Clock::time_point now) {
+        for(auto it = shard.sessions.begin(); it != shard.sessions.end(); )
+            it = it->second.expiry <= now ? shard.sessions.erase(it) : next(it);
+        if(shard.sessions.size() < shardCapacity) return;
+        auto oldest = shard.sessions.begin();
+        for(auto it = shard.sessions.begin(); it != shard.sessions.end(); ++it)
+            if(it->second.expiry < oldest->second.expiry) oldest = it;
+        shard.sessions.erase(oldest);
+    }
+public:
+    static constexpr chrono::minutes sessionIdle{30};
+    string open(const string &uid) {
+        unsigned char bytes[16];
+        randomBytes(bytes, sizeof(bytes));
+        string token = toHex(bytes, sizeof(bytes));
+        Shard &shard = shardOf(token);
+        Clock::time_point now = Clock::now();
+        lock_guard<mutex> lock(shard.lock);
+        if(shard.sessions.size() >= shardCapacity)
+            evict(shard, now);
+        shard.sessions[token] = Session { uid, now + sessionIdle };
+        return token;
+    }
+    // Finds the user of a live session and extends it.
+    bool resume(const string &token, string &uid) {
+        Shard &shard = shardOf(token);
+        Clock::time_point now = Clock::now();
+        lock_guard<mutex> lock(shard.lock);
+        auto it = shard.sessions.find(token);
+        if(it == shard.sessions.end()) return false;
+        if(it->second.expiry <= now) {
+            shard.sessions.erase(it);
+            return false;
+        }
+        it->second.expiry = now + sessionIdle;
+        uid = it->second.userID;
+        return true;
+    }
+    void close(const string &token) {
+        Shard &shard = shardOf(token);
+        lock_guard<mutex> lock(shard.lock);
+        shard.sessions.erase(token);
+    }
+    void closeUser(const string &uid) {
+        for(Shard &shard : shards) {
+            lock_guard<mutex> lock(shard.lock);
+            for(auto it = shard.sessions.begin(); it != shard.sessions.end(); )
+                it = it->second.userID == uid ? shard.sessions.erase(it) : next(it);
+        }
+    }
+};
+
+// formatUsers' cursor once the last user has been listed.
+const uint64_t endOfUsers = numeric_limits<uint64_t>::max();
+
+class Library {
+private:
+    deque<Book> books;
+    vector<User*> users;
+    // users stays in the order users were added; userOrder[i] numbers
+    // users[i] in that order. A removal shifts the positions after it
+    // but not the numbers, so listings page by number.
+    vector<uint64_t> userOrder;
+    uint64_t usersAdded = 0;
+    vector<IssuedRecord> issued;
+    // Several desks may use one Library at a time. Loading, checkpoints,
+    // the overdue sweep and adding or removing books and users hold
+    // structureLock exclusively; every other operation holds it shared.
+    // A book's state is guarded by its stripe in bookLocks and an
+    // account's by its stripe in userLocks. Issue and return take both
+    // stripes at once with scoped_lock, so desks handling different books
+    // proceed in parallel and a book can never be issued twice. ledgerLock,
+    // holdLock, journalLock and historyLock come last in the lock order:
+    // they are taken with structureLock and stripes already held (startHold
+    // takes holdLock under the book's stripe, logBook journalLock), and no
+    // other lock is taken while one of them is held.
+    static const size_t lockStripes = 64;
+    mutable shared_mutex structureLock;
+    mutable array<mutex, lockStripes> bookLocks;
+    mutable array<mutex, lockStripes> userLocks;
+    mutable mutex ledgerLock;
+    mutex holdLock;
+    mutex journalLock;
+    mutable mutex historyLock;
+    mutex &bookStripe(BookHandle h) const { return bookLocks[h % lockStripes]; }
+    mutex &userStripe(const string &uid) const { return userLocks[hash<string>()(uid) % lockStripes]; }
+    // Loading and saving report progress and errors here. Null keeps the
+    // engine quiet, which is the default for embedders.
+    ostream* notices = nullptr;
+    template<typename... Parts>
+    void notice(const Parts&... parts) const {
+        if(notices)
+            (*notices << ... << parts) << '\n';
+    }
+    // Secondary indexes over issued: the slot holding each book's loan and
+    // the slots belonging to each user. Removal moves the last record into
+    // the freed slot, so both indexes are patched in constant time.
+    unordered_map<BookHandle, size_t> loanByBook;
+    unordered_map<string, vector<size_t>> loansByUser;
+    void addLoan(const IssuedRecord &r) {
+        lock_guard<mutex> lock(ledgerLock);
+        loanByBook[r.book] = issued.size();
+        loansByUser[r.userID].push_back(issued.size());
+        issued.push_back(r);
+    }
+    bool removeLoan(const string &uid, BookHandle h, IssuedRecord* removed = nullptr) {
+        lock_guard<mutex> lock(ledgerLock);
+        auto byBook = loanByBook.find(h);
+        if(byBook == loanByBook.end() || issued[byBook->second].userID != uid)
+            return false;
+        size_t slot = byBook->second;
+        if(removed)
+            *removed = issued[slot];
+        loanByBook.erase(byBook);
+        auto byUser = loansByUser.find(uid);
+        vector<size_t> &mine = byUser->second;
+        mine.erase(find(mine.begin(), mine.end(), slot));
+        if(mine.empty())
+            loansByUser.erase(byUser);
+        size_t last = issued.size() - 1;
+        if(slot != last) {
+            issued[slot] = std::move(issued[last]);
+            loanByBook[issued[slot].book] = slot;
+            vector<size_t> &moved = loansByUser[issued[slot].userID];
+            *find(moved.begin(), moved.end(), last) = slot;
+        }
+        issued.pop_back();
+        return true;
+    }
+    void rebuildLoanIndexes() {
+        loanByBook.clear();
+        loansByUser.clear();
+        loanByBook.reserve(issued.size());
+        for(size_t i = 0; i < issued.size(); ++i) {
+            loanByBook[issued[i].book] = i;
+            loansByUser[issued[i].userID].push_back(i);
+        }
+    }
+    // Borrowed lists are not persisted; they are derived from the ledger.
+    void rebuildAccounts() {
+        for(User* u : users)
+            u->getAccount().clearBorrowedBooks();
+        for(const auto &entry : loansByUser) {
+            User* u = lookupUser(entry.first);
+            if(!u) continue;
+            for(size_t slot : entry.second)
+                u->getAccount().addBorrowedBook(issued[slot].book);
+        }
+    }
+    // Every book held keeps its text in bookArena, copied there under the
+    // exclusive structureLock, and users read from disk are built in
+    // userArena; both are freed by a reload. The
+    // index keys are views of the books' and users' own IDs.
+    Arena bookArena;
+    Arena userArena;
+    unordered_map<string_view, BookHandle> isbnIndex;
+    unordered_map<string_view, User*> userIndex;    // user ID -> user
+    CatalogSearch catalogSearch;
+    CatalogColumns columns;
+    // Min-heap of (expiry, book) for every hold placed. Entries are never
+    // removed early: one whose book has since been borrowed, or re-held
+    // with a later expiry, is recognised as stale and skipped when popped.
+    typedef pair<time_t, BookHandle> HoldTimer;
+    priority_queue<HoldTimer, vector<HoldTimer>, greater<HoldTimer>> holdTimers;
+    // The hold lasts as long as the role of the patron it is for allows;
+    // returns that many days.
+    int startHold(BookHandle h, time_t now) {
+        Book &b = books[h];
+        User* holder = lookupUser(b.getReservedBy());
+        int days = holder ? holder->getPolicy().holdDays : BorrowingPolicy().holdDays;
+        b.setStatus(BookStatus::Reserved);
+        b.setReservationExpiry(now + static_cast<time_t>(days) * 24 * 3600);
+        lock_guard<mutex> lock(holdLock);
+        holdTimers.emplace(b.getReservationExpiry(), h);
+        return days;
+    }
+    void rebuildHoldTimers() {
+        vector<HoldTimer> timers;
+        for(BookHandle h = 0; h < books.size(); ++h)
+            if(books[h].getStatus() == BookStatus::Reserved)
+                timers.emplace_back(books[h].getReservationExpiry(), h);
+        holdTimers = priority_queue<HoldTimer, vector<HoldTimer>, greater<HoldTimer>>(greater<HoldTimer>(), std::move(timers));
+    }
+    // Mutations are appended to the journal and only folded into the
+    // segment files at checkpoints; loadAllData replays whatever the
+    // journal holds.
+    static const size_t checkpointInterval = 1000;
+    const string journalFile = "journal.log";
+    const string previousJournalFile = "journal.prev";
+    const string snapshotFile = "library.snap";
+    const string policyFile = "policy.csv";
+    bool snapshotMode = false;   // checkpoints write library.snap instead of CSVs
+    // In snapshot mode most checkpoints leave library.snap alone and keep
+    // journal.prev, which then holds every change made since the snapshot
+    // was written. The snapshot is only rewritten, and journal.prev
+    // deleted, once those changes number more than an eighth of the books
+    // and users, so each change pays a bounded share of the rewrite and
+    // startup replays at most that many records. Only checkpoints touch
+    // journalSinceSnapshot, under checkpointLock.
+    static const size_t snapshotRebuildShare = 8;
+    size_t journalSinceSnapshot = 0;
+    // Without a snapshot the tables live in segment files under data/, and
+    // a checkpoint rewrites only the segments whose flags are set. Books
+    // are segmented by handle and loans by their book's handle, so both
+    // stay put as the catalog grows; users are spread over a fixed number
+    // of segments by a hash of their ID.
+    static const size_t booksPerSegment = 4096;
+    static const size_t userSegmentCount = 256;
+    const string segmentDirectory = "data";
+    DirtySegments dirtyBooks, dirtyIssued;
+    DirtySegments dirtyUsers { userSegmentCount };
+    bool rewriteAllSegments = false;   // next checkpoint writes every segment and retires books.csv and co.
+    static size_t bookSegment(BookHandle h) { return h / booksPerSegment; }
+    static size_t userSegment(const string &uid) { return stableHash(uid) % userSegmentCount; }
+    string segmentPath(const char* table, size_t segment) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%s-%06zu.csv", table, segment);
+        return segmentDirectory + "/" + name;
+    }
+    void growSegments() {
+        size_t count = (books.size() + booksPerSegment - 1) / booksPerSegment;
+        dirtyBooks.grow(count);
+        dirtyIssued.grow(count);
+    }
+    // Records wait in journalQueue until an operation commits. The first
+    // desk to commit while no write is under way takes the whole queue,
+    // writes it and syncs the file once with journalLock released; desks
+    // that commit meanwhile wait, and the next of them writes everything
+    // queued behind that write as one group.
+    JournalFile journal;
+    string journalQueue;
+    uint64_t journalQueued = 0, journalDurable = 0;
+    bool journalWriting = false;
+    condition_variable journalWritten;
+    atomic<size_t> journalRecords { 0 };
+    void appendJournal(char type, const string &payload) {
+        lock_guard<mutex> lock(journalLock);
+        journalQueue += type;
+        journalQueue += ',';
+        journalQueue += payload;
+        journalQueue += '\n';
+        ++journalQueued;
+        METRIC_COUNT(JournalBytes, payload.size() + 3);
+        ++journalRecords;
+    }
+    // Each record also marks the segment it changes.
+    void logBook(BookHandle h) {
+        columns.setStatus(h, books[h].getStatus());
+        dirtyBooks.mark(bookSegment(h));
+        appendJournal('B', books[h].toCSV());
+    }
+    void logUser(const User* u) {
+        dirtyUsers.mark(userSegment(u->getID()));
+        appendJournal('U', u->toCSV());
+    }
+    void logUserRemoved(const string &uid) {
+        dirtyUsers.mark(userSegment(uid));
+        appendJournal('D', csvField(uid));
+    }
+    void logIssue(const IssuedRecord &r) {
+        dirtyIssued.mark(bookSegment(r.book));
+        appendJournal('I', csvField(r.userID) + "," + csvField(books[r.book].getISBN()) + "," + to_string(r.issueTime));
+    }
+    void logReturn(const LoanHistoryRecord &closed, BookHandle h) {
+        dirtyIssued.mark(bookSegment(h));
+        appendJournal('R', csvField(closed.userID) + "," + csvField(closed.isbn) + "," + to_string(closed.sequence)
+                           + "," + to_string(closed.issueTime) + "," + to_string(closed.returnTime)
+                           + "," + formatAmount(closed.fine));
+    }
+    // Closed loans wait in historyPending, in sequence order, until a
+    // checkpoint appends them to the archive; historyInFlight holds the
+    // ones a checkpoint is writing, so queries still see them meanwhile.
+    // The journal's return records carry the same fields, and replay puts
+    // back any the archive does not hold yet.
+    SessionCache sessions;
+    LoanHistory history;
+    vector<LoanHistoryRecord> historyPending, historyInFlight;
+    uint64_t historySequence = 0;
+    LoanHistoryRecord closeLoan(const IssuedRecord &loan, time_t now, double fine) {
+        lock_guard<mutex> lock(historyLock);
+        historyPending.push_back(LoanHistoryRecord { ++historySequence, loan.userID, string(books[loan.book].getISBN()),
+                                                     loan.issueTime, now, fine });
+        return historyPending.back();
+    }
+    // Returns once every record queued so far is on disk.
+    void commit() {
+        unique_lock<mutex> lock(journalLock);
+        uint64_t wanted = journalQueued;
+        while(journalDurable < wanted) {
+            if(journalWriting) {
+                journalWritten.wait(lock);
+                continue;
+            }
+            journalWriting = true;
+            string batch;
+            batch.swap(journalQueue);
+            uint64_t upTo = journalQueued;
+            lock.unlock();
+            bool written;
+            {
+                METRIC_TIMER(timer, SyncJournal);
+                METRIC_BYTES(timer, batch.size());
+                written = (journal.isOpen() || journal.open(journalFile, false)) && journal.append(batch);
+                METRIC_OUTCOME(timer, written);
+            }
+            if(!written)
+                notice("Error writing to \"", journalFile, "\"");
+            lock.lock();
+            journalWriting = false;
+            journalDurable = upTo;
+            journalWritten.notify_all();
+        }
+    }
+    // A full journal is folded into the files by the checkpointer thread,
+    // so the operation that notices it does not wait for the disk. Each
+    // checkpoint moves the journal aside to journal.prev, renders the tables
+    // under structureLock held shared, locking each book and account only
+    // while its row is written, and then replaces the files with no library
+    // lock held. Desks keep working meanwhile, so the files can be ahead of
+    // journal.prev; replay treats every record as an upsert, which makes
+    // that harmless. journal.prev is deleted once the files are on disk.
+    // checkpointLock runs checkpoints one at a time and is always taken
+    // before structureLock.
+    mutex checkpointLock;
+    mutex checkpointerLock;
+    condition_variable checkpointerWake;
+    bool checkpointWanted = false, checkpointerStopping = false;
+    thread checkpointer;
+    void checkpointIfDue() {
+        if(journalRecords < checkpointInterval) return;
+        lock_guard<mutex> lock(checkpointerLock);
+        if(!checkpointer.joinable())
+            checkpointer = thread(&Library::runCheckpointer, this);
+        checkpointWanted = true;
+        checkpointerWake.notify_one();
+    }
+    void runCheckpointer() {
+        unique_lock<mutex> lock(checkpointerLock);
+        while(true) {
+            checkpointerWake.wait(lock, [this] { return checkpointWanted || checkpointerStopping; });
+            if(checkpointerStopping)
+                return;
+            checkpointWanted = false;
+            lock.unlock();
+            {
+                lock_guard<mutex> serial(checkpointLock);
+                if(journalRecords >= checkpointInterval) {
+                    CheckpointImage image;
+                    {
+                        shared_lock<shared_mutex> structure(structureLock);
+                        image = beginCheckpoint();
+                    }
+                    finishCheckpoint(image, false);
+                }
+            }
+            lock.lock();
+        }
+    }
+    void stopCheckpointer() {
+        {
+            lock_guard<mutex> lock(checkpointerLock);
+            checkpointerStopping = true;
+            checkpointerWake.notify_one();
+        }
+        if(checkpointer.joinable())
+            checkpointer.join();
+    }
+    // Starts a fresh journal.log for changes made from here on and returns
+    // the number of records the old one held. They move to journal.prev,
+    // after anything already there, and are on disk before journal.log is
+    // cut; if they cannot be moved journal.log is kept as it is. Records
+    // still queued are written to the new journal, after all of the old
+    // one, so replay sees them in order.
+    size_t rotateJournal() {
+        unique_lock<mutex> lock(journalLock);
+        journalWritten.wait(lock, [this] { return !journalWriting; });
+        journal.close();
+        error_code error;
+        bool moved;
+        if(!filesystem::exists(previousJournalFile, error)) {
+            filesystem::rename(journalFile, previousJournalFile, error);
+            moved = !error || !filesystem::exists(journalFile, error);
+#ifndef _WIN32
+            syncDirectoryOf(previousJournalFile);
+#endif
+        } else {
+            ifstream current(journalFile, ios::binary);
+            string records((istreambuf_iterator<char>(current)), istreambuf_iterator<char>());
+            JournalFile previous;
+            moved = records.empty() || (previous.open(previousJournalFile, false) && previous.append(records));
+        }
+        if(!moved) {
+            notice("Error moving \"", journalFile, "\" to \"", previousJournalFile, "\"");
+            return 0;
+        }
+        journal.open(journalFile, true);
+        return journalRecords.exchange(0);
+    }
+    // Returns false for a record that cannot be parsed, which can only be
+    // a torn tail from an interrupted write.
+    bool replayRecord(char type, string_view payload) {
+        CsvRow row;
+        if(!row.parse(payload)) return false;
+        if(type == 'B') {
+            Book b;
+            if(!Book::fromFields(row, b, &bookArena)) return false;
+            BookHandle h = lookupBook(b.getISBN());
+            if(h != noBook) {
+                books[h] = b;
+                columns.set(h, b);
+            } else {
+                h = books.size();
+                books.push_back(b);
+                indexBook(h);
+            }
+            dirtyBooks.mark(bookSegment(h));
+        } else if(type == 'U') {
+            User* u = userFromFields(row);
+            if(!u) return false;
+            dirtyUsers.mark(userSegment(u->getID()));
+            User* existing = lookupUser(u->getID());
+            if(existing) {
+                existing->updateFrom(*u);
+                delete u;
+            } else {
+                appendUser(u);
+                userIndex[u->getID()] = u;
+            }
+        } else if(type == 'D') {
+            string uid(row[0]);
+            User* u = lookupUser(uid);
+            if(!u) return true;
+            dirtyUsers.mark(userSegment(uid));
+            eraseUser(u);
+            userIndex.erase(uid);
+            releaseUser(u);
+        } else if(type == 'I') {
+            time_t issueTime;
+            if(row.size() < 3 || !parseNumber(row[2], issueTime)) return false;
+            BookHandle h = lookupBook(string(row[1]));
+            if(h == noBook) return true;
+            IssuedRecord current;
+            if(findLoan(h, current))
+                removeLoan(current.userID, h);
+            addLoan(IssuedRecord { string(row[0]), h, issueTime });
+            dirtyIssued.mark(bookSegment(h));
+        } else if(type == 'R') {
+            if(row.size() < 2) return false;
+            BookHandle h = lookupBook(string(row[1]));
+            if(removeLoan(string(row[0]), h))
+                dirtyIssued.mark(bookSegment(h));
+            // Journals from before the history was kept have no more fields.
+            if(row.size() >= 6) {
+                LoanHistoryRecord closed { 0, string(row[0]), string(row[1]), 0, 0, 0 };
+                if(!parseNumber(row[2], closed.sequence) || !parseNumber(row[3], closed.issueTime)
+                   || !parseNumber(row[4], closed.returnTime) || !parseNumber(row[5], closed.fine))
+                    return false;
+                if(closed.sequence > history.lastSequence())
+                    historyPending.push_back(closed);
+            }
+        } else {
+            return false;
+        }
+        return true;
+    }
+    size_t replayJournal(const string &filename) {
+        CsvReader reader(filename);
+        if(!reader.isOpen()) return 0;
+        size_t replayed = 0;
+        string_view line;
+        while(reader.nextLine(line)) {
+            ++replayed;
+            if(line.size() < 2 || line[1] != ',' || !replayRecord(line[0], line.substr(2)))
+                break;
+        }
+        return replayed;
+    }
+    void indexBook(BookHandle h) {
+        isbnIndex[books[h].getISBN()] = h;
+        catalogSearch.add(h, books[h]);
+        columns.set(h, books[h]);
+        growSegments();
+    }
+    void rebuildBookIndex(bool withSearch = true) {
+        isbnIndex.clear();
+        isbnIndex.reserve(books.size());
+        if(withSearch)
+            catalogSearch.clear();
+        columns.clear();
+        for(BookHandle h = 0; h < books.size(); ++h) {
+            isbnIndex.emplace(books[h].getISBN(), h);
+            if(withSearch)
+                catalogSearch.add(h, books[h]);
+            columns.set(h, books[h]);
+        }
+        growSegments();
+    }
+    // Roles missing from policy.csv keep their built-in rules. A role is
+    // never removed, since users may still refer to it.
+    void loadPolicies() {
+        CsvReader reader(policyFile);
+        if(!reader.isOpen()) return;
+        CsvRow row;
+        string_view line;
+        size_t lineNumber = 0, loaded = 0;
+        while(reader.nextLine(line)) {
+            ++lineNumber;
+            if(line.empty() || line.rfind("role,", 0) == 0) continue;
+            BorrowingPolicy p;
+            if(!row.parse(line) || !policyFromFields(row, p) || !policies.set(p)) {
+                notice("Ignoring invalid line ", lineNumber, " of \"", policyFile, "\"");
+                continue;
+            }
+            ++loaded;
+        }
+        notice("Loaded ", loaded, " borrowing policies from \"", policyFile, "\"");
+    }
+    // Lookups for callers already holding structureLock.
+    BookHandle lookupBook(string_view isbn) const {
+        auto it = isbnIndex.find(isbn);
+        if(it == isbnIndex.end()) {
+            METRIC_COUNT(IsbnIndexMisses, 1);
+            return noBook;
+        }
+        METRIC_COUNT(IsbnIndexHits, 1);
+        return it->second;
+    }
+    User* lookupUser(const string &uid) const {
+        auto it = userIndex.find(uid);
+        if(it == userIndex.end()) {
+            METRIC_COUNT(UserIndexMisses, 1);
+            return nullptr;
+        }
+        METRIC_COUNT(UserIndexHits, 1);
+        return it->second;
+    }
+    // Users handed over by addNewUser or replayed from the journal are on
+    // the heap; the rest are in userArena.
+    void releaseUser(User* u) {
+        if(userArena.owns(u))
+            u->~User();
+        else
+            delete u;
+    }
+    void appendUser(User* u) {
+        users.push_back(u);
+        userOrder.push_back(usersAdded++);
+    }
+    void eraseUser(User* u) {
+        size_t i = find(users.begin(), users.end(), u) - users.begin();
+        users.erase(users.begin() + i);
+        userOrder.erase(userOrder.begin() + i);
+    }
+    void clearUsers() {
+        for(auto u : users)
+            releaseUser(u);
+        users.clear();
+        userOrder.clear();
+        userIndex.clear();
+        userArena.clear();
+    }
+    void clearBooks() {
+        books.clear();
+        isbnIndex.clear();
+        bookArena.clear();
+    }
+    // Nightly fine pass over every open loan. Loans are gathered user by
+    // user into flat columns so the loan period and fine rate are looked
+    // up once per user; the overdue arithmetic then runs as one tight loop
+    // over the columns. Each account's accrued balance is replaced with
+    // the result. Charged fines are left alone: the actual fine is still
+    // applied when the book comes back.
+    OverdueSummary sweepOverdue(time_t now) {
+        size_t n = issued.size();
+        vector<size_t> slots(n);
+        vector<time_t> issueTimes(n);
+        vector<time_t> dueSeconds(n);
+        vector<int32_t> graceDays(n);
+        vector<double> rates(n);
+        vector<uint32_t> owners(n);
+        vector<User*> ownerUsers;
+        size_t k = 0;
+        for(const auto &entry : loansByUser) {
+            User* u = lookupUser(entry.first);
+            const BorrowingPolicy* policy = u ? &u->getPolicy() : nullptr;
+            time_t due = policy ? static_cast<time_t>(policy->loanDays) * 24 * 3600 : 0;
+            int32_t grace = policy ? policy->graceDays : 0;
+            double rate = policy ? policy->finePerDay : 0;
+            uint32_t owner = static_cast<uint32_t>(ownerUsers.size());
+            ownerUsers.push_back(u);
+            for(size_t slot : entry.second) {
+                slots[k] = slot;
+                issueTimes[k] = issued[slot].issueTime;
+                dueSeconds[k] = due;
+                graceDays[k] = grace;
+                rates[k] = rate;
+                owners[k] = owner;
+                ++k;
+            }
+        }
+        vector<int32_t> daysOverdue(k);
+        vector<double> fines(k);
+        for(size_t i = 0; i < k; ++i) {
+            time_t late = now - issueTimes[i] - dueSeconds[i];
+            int32_t days = late > 0 ? static_cast<int32_t>(late / (24 * 3600)) : 0;
+            daysOverdue[i] = days;
+            fines[i] = max(days - graceDays[i], 0) * rates[i];
+        }
+        OverdueSummary summary;
+        summary.openLoans = k;
+        vector<double> accrued(ownerUsers.size(), 0.0);
+        for(size_t i = 0; i < k; ++i) {
+            if(daysOverdue[i] == 0) continue;
+            accrued[owners[i]] += fines[i];
+            summary.totalAccrued += fines[i];
+            const IssuedRecord &r = issued[slots[i]];
+            summary.overdue.push_back(OverdueLoan { r.userID, r.book, r.issueTime, daysOverdue[i], fines[i] });
+        }
+        for(User* u : users)
+            u->getAccount().setAccruedFine(0);
+        for(size_t j = 0; j < ownerUsers.size(); ++j)
+            if(ownerUsers[j])
+                ownerUsers[j]->getAccount().setAccruedFine(accrued[j]);
+        return summary;
+    }
+    // Same computation as the sweep for a single user's open loans.
+    void refreshAccruedFine(User* u, time_t now) {
+        const BorrowingPolicy &policy = u->getPolicy();
+        time_t due = static_cast<time_t>(policy.loanDays) * 24 * 3600;
+        double accrued = 0;
+        for(const IssuedRecord &r : loansOf(u->getID())) {
+            time_t late = now - r.issueTime - due;
+            if(late > 0)
+                accrued += max(static_cast<int32_t>(late / (24 * 3600)) - policy.graceDays, 0) * policy.finePerDay;
+        }
+        u->getAccount().setAccruedFine(accrued);
+    }
+    // The lock order is book stripe, then holdLock: startHold below takes
+    // holdLock under the stripe to queue the next patron's timer. So the
+    // due timers are taken off the heap first, and holdLock is released
+    // before any book is locked.
+    size_t expireHolds(time_t now) {
+        vector<HoldTimer> due;
+        {
+            lock_guard<mutex> lock(holdLock);
+            while(!holdTimers.empty() && holdTimers.top().first < now) {
+                due.push_back(holdTimers.top());
+                holdTimers.pop();
+            }
+        }
+        size_t expired = 0;
+        for(const HoldTimer &timer : due) {
+            lock_guard<mutex> lock(bookStripe(timer.second));
+            Book &b = books[timer.second];
+            if(b.getStatus() != BookStatus::Reserved || b.getReservationExpiry() != timer.first)
+                continue;
+            b.popReservation();
+            if(b.hasReservation()) {
+                startHold(timer.second, now);
+            } else {
+                b.setStatus(BookStatus::Available);
+                b.setReservationExpiry(0);
+            }
+            logBook(timer.second);
+            ++expired;
+        }
+        if(expired > 0)
+            commit();
+        return expired;
+    }
+    // Circulation rules shared by the single calls and applyBatch. The
+    // caller holds structureLock shared plus the book's stripe, and for
+    // issue and return the user's stripe too; it also flushes the journal.
+    OpStatus issueLocked(const string &uid, BookHandle h, time_t now) {
+        Book &book = books[h];
+        if(book.getStatus() == BookStatus::Borrowed)
+            return OpStatus::BookUnavailable;
+        if(book.getStatus() == BookStatus::Reserved && (book.getReservedBy() != uid || now > book.getReservationExpiry()))
+            return OpStatus::ReservedByOther;
+        User* u = lookupUser(uid);
+        if(!u)
+            return OpStatus::UserNotFound;
+        if(u->getAccount().getFine() > 0 || (u->getPolicy().clearanceBlocks && u->getAccount().isFineSettlementPending()))
+            return OpStatus::FineOutstanding;
+        OpStatus status;
+        {
+            METRIC_TIMER(rules, BorrowRules);
+            status = u->borrowBook(&book, h);
+            METRIC_OUTCOME(rules, status == OpStatus::Ok);
+        }
+        if(status != OpStatus::Ok)
+            return status;
+        IssuedRecord rec { uid, h, now };
+        addLoan(rec);
+        logBook(h);
+        logIssue(rec);
+        return OpStatus::Ok;
+    }
+    OpStatus returnLocked(const string &uid, BookHandle h, int daysBorrowed, time_t now, OpResult &result) {
+        IssuedRecord loan;
+        if(!removeLoan(uid, h, &loan))
+            return OpStatus::NotBorrowed;
+        Book &book = books[h];
+        User* u = lookupUser(uid);
+        if(u) {
+            result.fine = u->returnBook(&book, h, daysBorrowed);
+            refreshAccruedFine(u, now);
+        }
+        if(book.hasReservation()) {
+            result.holdDays = startHold(h, now);
+            result.heldFor = book.getReservedBy();
+        } else
+            book.setStatus(BookStatus::Available);
+        logReturn(closeLoan(loan, now, result.fine), h);
+        logBook(h);
+        if(u)
+            logUser(u);
+        return OpStatus::Ok;
+    }
+    OpStatus reserveLocked(const string &uid, BookHandle h, OpResult &result) {
+        Book &book = books[h];
+        if(book.getStatus() == BookStatus::Available)
+            return OpStatus::BookAvailable;
+        IssuedRecord loan;
+        if(findLoan(h, loan) && loan.userID == uid)
+            return OpStatus::AlreadyBorrowed;
+        if(book.isInReservationQueue(uid))
+            return OpStatus::AlreadyReserved;
+        book.enqueueReservation(uid);
+        result.queuePosition = book.getReservationQueueLength();
+        User* u = lookupUser(uid);
+        result.holdDays = u ? u->getPolicy().holdDays : BorrowingPolicy().holdDays;
+        logBook(h);
+        return OpStatus::Ok;
+    }
+public:
+    void setNotices(ostream* out) { notices = out; }
+    OpStatus addNewBook(const Book &b) {
+        checkpointIfDue();
+        unique_lock<shared_mutex> structure(structureLock);
+        if(lookupBook(b.getISBN()) != noBook)
+            return OpStatus::DuplicateBook;
+        books.push_back(b);
+        books.back().moveTextInto(bookArena);
+        indexBook(books.size() - 1);
+        logBook(books.size() - 1);
+        commit();
+        return OpStatus::Ok;
+    }
+    BookHandle findBook(const string &isbn) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        return lookupBook(isbn);
+    }
+    // Books are never removed, so handles and pointers stay valid.
+    Book* getBook(BookHandle h) {
+        shared_lock<shared_mutex> structure(structureLock);
+        return h < books.size() ? &books[h] : nullptr;
+    }
+    Book* searchBookByISBN(const string &isbn) { return getBook(findBook(isbn)); }
+    bool formatBook(BookHandle h, const string &currentUserID, string &out) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        if(h >= books.size()) return false;
+        lock_guard<mutex> lock(bookStripe(h));
+        books[h].format(out, currentUserID, time(0));
+        return true;
+    }
+    bool bookToJSON(BookHandle h, string &out) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        if(h >= books.size()) return false;
+        lock_guard<mutex> lock(bookStripe(h));
+        books[h].toJSON(out);
+        return true;
+    }
+    CatalogSearch::Results searchCatalog(const string &query, size_t offset, size_t limit) const {
+        METRIC_TIMER(timer, SearchCatalog);
+        shared_lock<shared_mutex> structure(structureLock);
+        return catalogSearch.search(query, offset, limit);
+    }
+    // Listings are produced a page at a time into a caller-owned buffer.
+    // Each call resumes at cursor and returns the cursor of the next page.
+    BookHandle formatBooks(const BookFilter &filter, BookHandle cursor, size_t limit,
+                           const string &currentUserID, string &out) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        time_t now = time(0);
+        size_t shown = 0;
+        for(BookHandle h = cursor; h < books.size(); ++h) {
+            lock_guard<mutex> lock(bookStripe(h));
+            if(!filter.matches(books[h])) continue;
+            if(shown == limit) return h;
+            books[h].format(out, currentUserID, now);
+            ++shown;
+        }
+        return noBook;
+    }
+    // Users are paged by their number in userOrder, so one removed
+    // between pages does not make the next page skip anyone.
+    uint64_t formatUsers(uint64_t cursor, size_t limit, string &out) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        size_t first = lower_bound(userOrder.begin(), userOrder.end(), cursor) - userOrder.begin();
+        size_t end = min(users.size(), first + limit);
+        for(size_t i = first; i < end; ++i) {
+            lock_guard<mutex> lock(userStripe(users[i]->getID()));
+            users[i]->format(out);
+            out += "---------------------\n";
+        }
+        return end < users.size() ? userOrder[end] : endOfUsers;
+    }
+    size_t formatIssued(size_t cursor, size_t limit, string &out) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        lock_guard<mutex> lock(ledgerLock);
+        size_t end = min(issued.size(), cursor + limit);
+        char date[64];
+        for(size_t i = cursor; i < end; ++i) {
+            const IssuedRecord &r = issued[i];
+            tm local = localTime(r.issueTime);
+            strftime(date, sizeof(date), "%a %b %e %H:%M:%S %Y\n", &local);
+            out += "User ID: "; out += r.userID;
+            out += ", ISBN: "; out += books[r.book].getISBN();
+            out += ", Issue Date: "; out += date;
+        }
+        return end;
+    }
+    size_t getUserCount() const {
+        shared_lock<shared_mutex> structure(structureLock);
+        return users.size();
+    }
+    size_t getIssuedCount() const {
+        lock_guard<mutex> lock(ledgerLock);
+        return issued.size();
+    }
+    // Archived loans first, then any not yet written out. The waiting
+    // loans are copied before the archive is searched: a checkpoint that
+    // archives them in between then only moves them into the search.
+    // Archive blocks that cannot be read are left out, counted in
+    // unreadable and reported.
+    vector<LoanHistoryRecord> loanHistory(const HistoryQuery &query, size_t &unreadable) const {
+        vector<LoanHistoryRecord> waiting;
+        {
+            lock_guard<mutex> lock(historyLock);
+            for(const vector<LoanHistoryRecord>* records : { &historyInFlight, &historyPending })
+                for(const LoanHistoryRecord &r : *records)
+                    if(query.matches(r))
+                        waiting.push_back(r);
+        }
+        uint64_t covered;
+        vector<LoanHistoryRecord> found = history.find(query, covered, unreadable);
+        if(unreadable > 0)
+            notice("Could not read ", unreadable, " block(s) of the loan history; their loans are left out");
+        for(const LoanHistoryRecord &r : waiting)
+            if(r.sequence > covered)
+                found.push_back(r);
+        return found;
+    }
+    // The status column and the loans change with every circulation call,
+    // so they are copied with structureLock held exclusively, which takes
+    // a few milliseconds even for millions of books. The scans then run
+    // alongside the desks; the other columns only change under the
+    // exclusive lock. since only applies to LoansByAuthor, which adds the
+    // loans returned since then from the loan history. That is searched
+    // after the lock is released, and only records closed before the copy
+    // are counted, since the later ones are still among the open loans.
+    Report report(ReportKind kind, const BookFilter &filter, time_t since = 0) const {
+        vector<uint8_t> statuses;
+        LoanColumns loans;
+        uint64_t closedBefore = 0;
+        {
+            unique_lock<shared_mutex> structure(structureLock);
+            statuses = columns.statuses();
+            if(kind == ReportKind::LoansByAuthor) {
+                loans.book.reserve(issued.size());
+                loans.issueTime.reserve(issued.size());
+                for(const IssuedRecord &r : issued) {
+                    loans.book.push_back(static_cast<uint32_t>(r.book));
+                    loans.issueTime.push_back(r.issueTime);
+                }
+                lock_guard<mutex> lock(historyLock);
+                closedBefore = historySequence;
+            }
+        }
+        vector<LoanHistoryRecord> returned;
+        size_t unreadable = 0;
+        if(kind == ReportKind::LoansByAuthor) {
+            HistoryQuery query;
+            query.from = since;
+            returned = loanHistory(query, unreadable);
+        }
+        shared_lock<shared_mutex> structure(structureLock);
+        for(const LoanHistoryRecord &r : returned) {
+            BookHandle h = r.sequence <= closedBefore && r.issueTime >= since ? lookupBook(r.isbn) : noBook;
+            if(h == noBook || h >= statuses.size()) continue;
+            loans.book.push_back(static_cast<uint32_t>(h));
+            loans.issueTime.push_back(r.issueTime);
+        }
+        vector<uint8_t> keep = columns.select(filter, statuses);
+        if(kind == ReportKind::LoansByAuthor) {
+            Report report = columns.loansByAuthor(keep, loans, since);
+            report.complete = unreadable == 0;
+            return report;
+        }
+        if(kind == ReportKind::UtilizationByYear)
+            return columns.utilizationByYear(keep, statuses);
+        return columns.collectionByPublisher(keep, statuses);
+    }
+    // JSON-lines export. Rows are formatted into a block buffer that is
+    // written out whenever it passes exportBlockSize.
+    static const size_t exportBlockSize = 1 << 20;
+    void exportBooks(ostream &os, const BookFilter &filter) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        string buffer;
+        for(BookHandle h = 0; h < books.size(); ++h) {
+            {
+                lock_guard<mutex> lock(bookStripe(h));
+                if(!filter.matches(books[h])) continue;
+                books[h].toJSON(buffer);
+            }
+            if(buffer.size() >= exportBlockSize) {
+                os.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        os.write(buffer.data(), buffer.size());
+    }
+    void exportUsers(ostream &os) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        string buffer;
+        for(const User* u : users) {
+            {
+                lock_guard<mutex> lock(userStripe(u->getID()));
+                u->toJSON(buffer);
+            }
+            if(buffer.size() >= exportBlockSize) {
+                os.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        os.write(buffer.data(), buffer.size());
+    }
+    void exportIssued(ostream &os) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        lock_guard<mutex> lock(ledgerLock);
+        string buffer;
+        for(const IssuedRecord &r : issued) {
+            buffer += "{\"userID\":"; buffer += jsonString(r.userID);
+            buffer += ",\"isbn\":"; buffer += jsonString(books[r.book].getISBN());
+            buffer += ",\"issueTime\":"; buffer += to_string(r.issueTime);
+            buffer += "}\n";
+            if(buffer.size() >= exportBlockSize) {
+                os.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+        os.write(buffer.data(), buffer.size());
+    }
+    // Takes ownership of u; a duplicate is deleted.
+    OpStatus addNewUser(User* u) {
+        checkpointIfDue();
+        unique_lock<shared_mutex> structure(structureLock);
+        if(lookupUser(u->getID()) != nullptr) {
+            delete u;
+            return OpStatus::DuplicateUser;
+        }
+        appendUser(u);
+        userIndex[u->getID()] = u;
+        logUser(u);
+        commit();
+        return OpStatus::Ok;
+    }
+    // A returned user stays valid until removeUserIfPossible deletes it.
+    User* getUserById(const string &uid) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        return lookupUser(uid);
+    }
+    OpStatus removeUserIfPossible(const string &uid) {
+        checkpointIfDue();
+        unique_lock<shared_mutex> structure(structureLock);
+        User* u = lookupUser(uid);
+        if(!u)
+            return OpStatus::UserNotFound;
+        if(u->getAccount().getBorrowedCount() > 0)
+            return OpStatus::HasLoans;
+        eraseUser(u);
+        userIndex.erase(uid);
+        releaseUser(u);
+        logUserRemoved(uid);
+        commit();
+        sessions.closeUser(uid);
+        return OpStatus::Ok;
+    }
+    OpResult issueBook(const string &uid, const string &isbn) {
+        METRIC_TIMER(timer, IssueBook);
+        checkpointIfDue();
+        expireReservations(time(0));
+        shared_lock<shared_mutex> structure(structureLock);
+        OpResult result;
+        BookHandle h = lookupBook(isbn);
+        if(h == noBook) {
+            METRIC_OUTCOME(timer, false);
+            result.status = OpStatus::BookNotFound;
+            return result;
+        }
+        scoped_lock desk(bookStripe(h), userStripe(uid));
+        result.status = issueLocked(uid, h, time(0));
+        METRIC_OUTCOME(timer, result.status == OpStatus::Ok);
+        if(result.status == OpStatus::Ok)
+            commit();
+        return result;
+    }
+    OpResult returnBook(const string &uid, const string &isbn, int daysBorrowed) {
+        METRIC_TIMER(timer, ReturnBook);
+        checkpointIfDue();
+        expireReservations(time(0));
+        shared_lock<shared_mutex> structure(structureLock);
+        OpResult result;
+        BookHandle h = lookupBook(isbn);
+        if(h == noBook) {
+            METRIC_OUTCOME(timer, false);
+            result.status = OpStatus::BookNotFound;
+            return result;
+        }
+        scoped_lock desk(bookStripe(h), userStripe(uid));
+        result.status = returnLocked(uid, h, daysBorrowed, time(0), result);
+        METRIC_OUTCOME(timer, result.status == OpStatus::Ok);
+        if(result.status == OpStatus::Ok)
+            commit();
+        return result;
+    }
+    // Applies the operations in order under the same rules as the calls
+    // above, with one hold-expiry pass, one journal flush and no console
+    // output for the whole batch.
+    vector<OpResult> applyBatch(const vector<BatchOp> &ops) {
+        checkpointIfDue();
+        vector<OpResult> results(ops.size());
+        {
+            shared_lock<shared_mutex> structure(structureLock);
+            time_t now = time(0);
+            expireHolds(now);
+            for(size_t i = 0; i < ops.size(); ++i) {
+                const BatchOp &op = ops[i];
+                BookHandle h = lookupBook(op.isbn);
+                if(h == noBook) {
+                    results[i].status = OpStatus::BookNotFound;
+                } else if(op.kind == OpKind::Reserve) {
+                    lock_guard<mutex> lock(bookStripe(h));
+                    results[i].status = reserveLocked(op.userID, h, results[i]);
+                } else {
+                    scoped_lock desk(bookStripe(h), userStripe(op.userID));
+                    if(op.kind == OpKind::Issue)
+                        results[i].status = issueLocked(op.userID, h, now);
+                    else
+                        results[i].status = returnLocked(op.userID, h, op.daysBorrowed, now, results[i]);
+                }
+            }
+            commit();
+        }
+        checkpointIfDue();
+        return results;
+    }
+    // Loans are returned by value: the ledger may be compacted by another
+    // desk as soon as ledgerLock is released.
+    bool findLoan(BookHandle h, IssuedRecord &loan) const {
+        lock_guard<mutex> lock(ledgerLock);
+        auto it = loanByBook.find(h);
+        if(it == loanByBook.end()) return false;
+        loan = issued[it->second];
+        return true;
+    }
+    vector<IssuedRecord> loansOf(const string &uid) const {
+        lock_guard<mutex> lock(ledgerLock);
+        vector<IssuedRecord> loans;
+        auto it = loansByUser.find(uid);
+        if(it != loansByUser.end())
+            for(size_t slot : it->second)
+                loans.push_back(issued[slot]);
+        return loans;
+    }
+    OverdueSummary runOverdueSweep(time_t now) {
+        unique_lock<shared_mutex> structure(structureLock);
+        return sweepOverdue(now);
+    }
+    bool writeOverdueReport(const OverdueSummary &summary, const string &filename) const {
+        ofstream outFile(filename);
+        if(!outFile) {
+            notice("Error writing to \"", filename, "\"");
+            return false;
+        }
+        shared_lock<shared_mutex> structure(structureLock);
+        string buffer = "userID,isbn,issueTime,daysOverdue,accruedFine\n";
+        for(const OverdueLoan &o : summary.overdue) {
+            buffer += csvField(o.userID); buffer += ',';
+            buffer += csvField(books[o.book].getISBN()); buffer += ',';
+            buffer += to_string(o.issueTime); buffer += ',';
+            buffer += to_string(o.daysOverdue); buffer += ',';
+            buffer += formatAmount(o.accruedFine); buffer += '\n';
+        }
+        outFile << buffer;
+        return true;
+    }
+    vector<IssuedRecord> overdueLoansOf(const User* u, time_t now) const {
+        vector<IssuedRecord> overdue;
+        time_t period = static_cast<time_t>(u->getPolicy().loanDays) * 24 * 3600;
+        for(const IssuedRecord &r : loansOf(u->getID()))
+            if(now - r.issueTime > period)
+                overdue.push_back(r);
+        return overdue;
+    }
+    // Appends the user's borrowed books to out and returns how many there are.
+    size_t formatBorrowedBooks(const User* u, string &out) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        vector<BookHandle> borrowed;
+        {
+            lock_guard<mutex> lock(userStripe(u->getID()));
+            borrowed = u->getAccount().getBorrowedBooks();
+        }
+        time_t now = time(0);
+        for(BookHandle h : borrowed) {
+            lock_guard<mutex> lock(bookStripe(h));
+            books[h].format(out, u->getID(), now);
+        }
+        return borrowed.size();
+    }
+    // Ends every hold that expired before now. The next patron in the
+    // book's queue, if any, gets a fresh hold; otherwise it goes back on
+    // the shelf. Returns the number of holds ended.
+    size_t expireReservations(time_t now) {
+        shared_lock<shared_mutex> structure(structureLock);
+        return expireHolds(now);
+    }
+    OpResult reserveBook(const string &uid, const string &isbn) {
+        METRIC_TIMER(timer, ReserveBook);
+        checkpointIfDue();
+        expireReservations(time(0));
+        shared_lock<shared_mutex> structure(structureLock);
+        OpResult result;
+        BookHandle h = lookupBook(isbn);
+        if(h == noBook) {
+            METRIC_OUTCOME(timer, false);
+            result.status = OpStatus::BookNotFound;
+            return result;
+        }
+        lock_guard<mutex> lock(bookStripe(h));
+        result.status = reserveLocked(uid, h, result);
+        METRIC_OUTCOME(timer, result.status == OpStatus::Ok);
+        if(result.status == OpStatus::Ok)
+            commit();
+        return result;
+    }
+    OpStatus requestFineClearance(const string &uid) {
+        checkpointIfDue();
+        shared_lock<shared_mutex> structure(structureLock);
+        User* u = lookupUser(uid);
+        if(!u) return OpStatus::UserNotFound;
+        lock_guard<mutex> lock(userStripe(uid));
+        Account &account = u->getAccount();
+        if(account.isFineSettlementPending()) return OpStatus::SettlementPending;
+        if(account.getFine() <= 0) return OpStatus::NoFine;
+        account.requestFineSettlement();
+        logUser(u);
+        commit();
+        return OpStatus::Ok;
+    }
+    OpStatus approveFineClearance(const string &uid) {
+        checkpointIfDue();
+        shared_lock<shared_mutex> structure(structureLock);
+        User* u = lookupUser(uid);
+        if(!u) return OpStatus::UserNotFound;
+        lock_guard<mutex> lock(userStripe(uid));
+        Account &account = u->getAccount();
+        if(!account.isFineSettlementPending()) return OpStatus::NoSettlementPending;
+        account.approveFineSettlement();
+        logUser(u);
+        commit();
+        return OpStatus::Ok;
+    }
+    // Copy of an account taken under its lock.
+    bool getAccount(const string &uid, Account &out) const {
+        shared_lock<shared_mutex> structure(structureLock);
+        User* u = lookupUser(uid);
+        if(!u) return false;
+        lock_guard<mutex> lock(userStripe(uid));
+        out = u->getAccount();
+        return true;
+    }
+    // Checks a password, upgrading one stored in plain text or at an old
+    // cost. The key derivation runs outside every lock, so logins proceed
+    // in parallel with each other and with desk work, and an unknown user
+    // costs as much as a wrong password.
+    OpStatus authenticate(const string &uid, const string &password) {
+        METRIC_TIMER(timer, Login);
+        string stored;
+        {
+            shared_lock<shared_mutex> structure(structureLock);
+            User* u = lookupUser(uid);
+            if(!u) {
+                structure.unlock();
+                checkPasswordDummy(password);
+                METRIC_OUTCOME(timer, false);
+                return OpStatus::UserNotFound;
+            }
+            lock_guard<mutex> lock(userStripe(uid));
+            stored = u->getPassword();
+        }
+        bool needsRehash = false;
+        bool matched = checkPassword(stored, password, needsRehash);
+        METRIC_OUTCOME(timer, matched);
+        if(!matched)
+            return OpStatus::InvalidLogin;
+        if(!needsRehash)
+            return OpStatus::Ok;
+        string upgraded = hashPassword(password);
+        checkpointIfDue();
+        shared_lock<shared_mutex> structure(structureLock);
+        User* u = lookupUser(uid);
+        if(!u) return OpStatus::UserNotFound;
+        lock_guard<mutex> lock(userStripe(uid));
+        if(u->getPassword() == stored) {
+            u->setPassword(upgraded);
+            logUser(u);
+            commit();
+        }
+        return OpStatus::Ok;
+    }
+    string openSession(const string &uid) { return sessions.open(uid); }
+    bool resumeSession(const string &token, string &uid) { return sessions.resume(token, uid); }
+    void closeSession(const string &token) { sessions.close(token); }
+    // Hashes every password still stored in plain text, spread over all
+    // cores. Returns how many were converted.
+    size_t hashStoredPasswords() {
+        unique_lock<shared_mutex> structure(structureLock);
+        vector<User*> plain;
+        for(User* u : users)
+            if(!isPasswordHash(u->getPassword()))
+                plain.push_back(u);
+        atomic<size_t> next(0);
+        vector<thread> workers;
+        for(unsigned t = 0; t < max(1u, thread::hardware_concurrency()); ++t)
+            workers.emplace_back([&] {
+                for(size_t i = next++; i < plain.size(); i = next++)
+                    plain[i]->setPassword(hashPassword(plain[i]->getPassword()));
+            });
+        for(thread &w : workers) w.join();
+        for(User* u : plain)
+            logUser(u);
+        commit();
+        return plain.size();
+    }
+private:
+    // Bulk loading and saving; callers hold structureLock exclusively.
+    // The read functions append the rows of one file to a table.
+    void readBooks(CsvReader &reader) {
+        CsvRow row;
+        string_view line;
+        while(reader.nextLine(line)) {
+            if(line.empty()) continue;
+            books.emplace_back();
+            if(!row.parse(line) || !Book::fromFields(row, books.back(), &bookArena))
+                books.pop_back();
+        }
+    }
+    void loadBooks(const string &filename) {
+        METRIC_TIMER(timer, LoadBooks);
+        CsvReader reader(filename);
+        if(!reader.isOpen()) {
+            METRIC_OUTCOME(timer, false);
+            notice("Books file \"", filename, "\" not found. It will be created on saving.");
+            return;
+        }
+        clearBooks();
+        readBooks(reader);
+        METRIC_BYTES(timer, reader.bytesRead());
+        rebuildBookIndex();
+        notice("Loaded books from \"", filename, "\"");
+    }
+    // Rows are rendered under structureLock, shared or exclusive, taking
+    // each row's stripe as it goes so circulation can continue alongside.
+    string renderBooks(BookHandle first = 0, BookHandle last = noBook) const {
+        string out;
+        for(BookHandle h = first; h < min<size_t>(last, books.size()); ++h) {
+            lock_guard<mutex> lock(bookStripe(h));
+            out += books[h].toCSV();
+            out += '\n';
+        }
+        return out;
+    }
+    bool saveFile(const string &filename, const string &contents, const char* what, bool announce) const {
+        if(!replaceFile(filename, contents)) {
+            notice("Error writing to \"", filename, "\"");
+            return false;
+        }
+        if(announce)
+            notice("Saved ", what, " to \"", filename, "\"");
+        return true;
+    }
+    bool saveBooks(const string &filename, const string &rows, bool announce = true) const {
+        METRIC_TIMER(timer, SaveBooks);
+        METRIC_BYTES(timer, rows.size());
+        bool saved = saveFile(filename, rows, "books", announce);
+        METRIC_OUTCOME(timer, saved);
+        return saved;
+    }
+    void loadUsers(const string &filename) {
+        METRIC_TIMER(timer, LoadUsers);
+        CsvReader reader(filename);
+        if(!reader.isOpen()) {
+            METRIC_OUTCOME(timer, false);
+            notice("Users file \"", filename, "\" not found. It will be created on saving.");
+            return;
+        }
+        clearUsers();
+        readUsers(reader);
+        METRIC_BYTES(timer, reader.bytesRead());
+        notice("Loaded users from \"", filename, "\"");
+    }
+    void readUsers(CsvReader &reader) {
+        CsvRow row;
+        string_view line;
+        while(reader.nextLine(line)) {
+            if(line.empty() || !row.parse(line)) continue;
+            User* u = userFromFields(row, &userArena);
+            if(!u) continue;
+            if(!userIndex.emplace(u->getID(), u).second) {
+                releaseUser(u);
+                continue;
+            }
+            appendUser(u);
+        }
+    }
+    string renderUsers() const {
+        string out;
+        for(const User* u : users) {
+            lock_guard<mutex> lock(userStripe(u->getID()));
+            out += u->toCSV();
+            out += '\n';
+        }
+        return out;
+    }
+    bool saveUsers(const string &filename, const string &rows, bool announce = true) const {
+        METRIC_TIMER(timer, SaveUsers);
+        METRIC_BYTES(timer, rows.size());
+        bool saved = saveFile(filename, rows, "users", announce);
+        METRIC_OUTCOME(timer, saved);
+        return saved;
+    }
+    void loadIssued(const string &filename) {
+        METRIC_TIMER(timer, LoadIssued);
+        CsvReader reader(filename);
+        if(!reader.isOpen()) {
+            METRIC_OUTCOME(timer, false);
+            notice("Issued records file \"", filename, "\" not found. It will be created on saving.");
+            return;
+        }
+        issued.clear();
+        readIssued(reader);
+        METRIC_BYTES(timer, reader.bytesRead());
+        rebuildLoanIndexes();
+        notice("Loaded issued records from \"", filename, "\"");
+    }
+    void readIssued(CsvReader &reader) {
+        CsvRow row;
+        string_view line;
+        string isbn;
+        while(reader.nextLine(line)) {
+            time_t issueTime;
+            if(line.empty() || !row.parse(line) || row.size() < 3 || !parseNumber(row[2], issueTime))
+                continue;
+            isbn.assign(row[1]);
+            BookHandle h = lookupBook(isbn);
+            if(h == noBook) continue;
+            issued.push_back(IssuedRecord { string(row[0]), h, issueTime });
+        }
+    }
+    string renderIssued() const {
+        vector<IssuedRecord> loans;
+        {
+            lock_guard<mutex> lock(ledgerLock);
+            loans = issued;
+        }
+        return renderLoans(loans);
+    }
+    // The loans of the books in [first, last).
+    string renderIssued(BookHandle first, BookHandle last) const {
+        vector<IssuedRecord> loans;
+        {
+            lock_guard<mutex> lock(ledgerLock);
+            for(BookHandle h = first; h < last; ++h) {
+                auto slot = loanByBook.find(h);
+                if(slot != loanByBook.end())
+                    loans.push_back(issued[slot->second]);
+            }
+        }
+        return renderLoans(loans);
+    }
+    string renderLoans(const vector<IssuedRecord> &loans) const {
+        string out;
+        for(const IssuedRecord &r : loans) {
+            out += csvField(r.userID);
+            out += ',';
+            out += csvField(books[r.book].getISBN());
+            out += ',';
+            out += to_string(r.issueTime);
+            out += '\n';
+        }
+        return out;
+    }
+    bool saveIssued(const string &filename, const string &rows, bool announce = true) const {
+        METRIC_TIMER(timer, SaveIssued);
+        METRIC_BYTES(timer, rows.size());
+        bool saved = saveFile(filename, rows, "issued records", announce);
+        METRIC_OUTCOME(timer, saved);
+        return saved;
+    }
+    string renderSnapshot() const {
+        SnapshotWriter writer;
+        vector<SnapBook> bookRecs;
+        bookRecs.reserve(books.size());
+        for(BookHandle h = 0; h < books.size(); ++h) {
+            lock_guard<mutex> lock(bookStripe(h));
+            const Book &b = books[h];
+            SnapBook rec;
+            rec.title = writer.add(b.getTitle());
+            rec.author = writer.add(b.getAuthor());
+            rec.publisher = writer.add(b.getPublisher());
+            rec.isbn = writer.add(b.getISBN());
+            rec.reservedBy = writer.add(b.getReservationQueueText());
+            rec.year = b.getYear();
+            rec.status = static_cast<uint8_t>(b.getStatus());
+            memset(rec.reserved, 0, sizeof(rec.reserved));
+            rec.reservationExpiry = b.getReservationExpiry();
+            bookRecs.push_back(rec);
+        }
+        vector<SnapUser> userRecs;
+        userRecs.reserve(users.size());
+        for(const User* u : users) {
+            lock_guard<mutex> lock(userStripe(u->getID()));
+            SnapUser rec;
+            rec.id = writer.add(u->getID());
+            rec.name = writer.add(u->getName());
+            rec.password = writer.add(u->getPassword());
+            rec.role = writer.add(roleName(u->getRole()));
+            rec.fine = u->getAccount().getFine();
+            userRecs.push_back(rec);
+        }
+        vector<SnapTerm> termRecs;
+        vector<SnapPosting> postingRecs;
+        catalogSearch.forEachTerm([&](const string &term, const vector<CatalogSearch::Posting> &list) {
+            termRecs.push_back(SnapTerm { writer.add(term), postingRecs.size(), list.size() });
+            for(const CatalogSearch::Posting &p : list)
+                postingRecs.push_back(SnapPosting { static_cast<uint32_t>(p.book), p.fields, { 0, 0, 0 } });
+        });
+        vector<IssuedRecord> loans;
+        {
+            lock_guard<mutex> lock(ledgerLock);
+            loans = issued;
+        }
+        vector<SnapIssued> issuedRecs;
+        issuedRecs.reserve(loans.size());
+        for(const IssuedRecord &r : loans) {
+            SnapIssued rec;
+            rec.userID = writer.add(r.userID);
+            rec.book = r.book;
+            rec.issueTime = r.issueTime;
+            issuedRecs.push_back(rec);
+        }
+        SnapshotHeader header;
+        memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+        header.version = snapshotVersion;
+        header.byteOrder = snapshotByteOrder;
+        header.bookCount = bookRecs.size();
+        header.userCount = userRecs.size();
+        header.issuedCount = issuedRecs.size();
+        header.heapSize = writer.getHeap().size();
+        SnapSearchHeader search { termRecs.size(), postingRecs.size() };
+        string out(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append(reinterpret_cast<const char*>(&search), sizeof(search));
+        out.append(reinterpret_cast<const char*>(bookRecs.data()), bookRecs.size() * sizeof(SnapBook));
+        out.append(reinterpret_cast<const char*>(userRecs.data()), userRecs.size() * sizeof(SnapUser));
+        out.append(reinterpret_cast<const char*>(issuedRecs.data()), issuedRecs.size() * sizeof(SnapIssued));
+        out.append(reinterpret_cast<const char*>(termRecs.data()), termRecs.size() * sizeof(SnapTerm));
+        out.append(reinterpret_cast<const char*>(postingRecs.data()), postingRecs.size() * sizeof(SnapPosting));
+        out.append(writer.getHeap().data(), writer.getHeap().size());
+        return out;
+    }
+    bool saveSnapshot(const string &filename, const string &image, bool announce = true) const {
+        METRIC_TIMER(timer, SaveSnapshot);
+        METRIC_BYTES(timer, image.size());
+        bool saved = saveFile(filename, image, "snapshot", announce);
+        METRIC_OUTCOME(timer, saved);
+        return saved;
+    }
+    bool restoreSearch(const SnapTerm* termRecs, uint64_t termCount, const SnapPosting* postingRecs,
+                       uint64_t postingCount, const char* heap, uint64_t heapSize) {
+        catalogSearch.clear();
+        catalogSearch.reserve(termCount);
+        for(uint64_t t = 0; t < termCount; ++t) {
+            const SnapTerm &rec = termRecs[t];
+            if(uint64_t(rec.term.offset) + rec.term.length > heapSize || rec.first > postingCount || rec.count > postingCount - rec.first)
+                return false;
+            vector<CatalogSearch::Posting> list(rec.count);
+            for(uint64_t i = 0; i < rec.count; ++i) {
+                const SnapPosting &p = postingRecs[rec.first + i];
+                if(p.book >= books.size() || (i > 0 && p.book <= list[i - 1].book))
+                    return false;
+                list[i] = CatalogSearch::Posting { p.book, p.fields };
+            }
+            if(!catalogSearch.restoreTerm(string_view(heap + rec.term.offset, rec.term.length), std::move(list)))
+                return false;
+        }
+        return true;
+    }
+    bool loadSnapshot(const string &filename) {
+        MappedFile file;
+        if(!file.open(filename))
+            return false;
+        METRIC_TIMER(timer, LoadSnapshot);
+        METRIC_OUTCOME(timer, false);
+        METRIC_BYTES(timer, file.size());
+        const char* base = file.begin();
+        SnapshotHeader header;
+        if(file.size() < sizeof(header)) {
+            notice("Snapshot \"", filename, "\" is truncated.");
+            return false;
+        }
+        memcpy(&header, base, sizeof(header));
+        if(memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 ||
+           header.version < 1 || header.version > snapshotVersion || header.byteOrder != snapshotByteOrder) {
+            notice("Snapshot \"", filename, "\" has an unsupported format.");
+            return false;
+        }
+        SnapSearchHeader search { 0, 0 };
+        uint64_t searchSize = header.version >= 4 ? sizeof(search) : 0;
+        if(file.size() < sizeof(header) + searchSize) {
+            notice("Snapshot \"", filename, "\" is truncated.");
+            return false;
+        }
+        memcpy(&search, base + sizeof(header), searchSize);
+        uint64_t bookSize = header.version == 1 ? sizeof(SnapBookV1) : sizeof(SnapBook);
+        uint64_t expected = sizeof(header) + searchSize + header.bookCount * bookSize
+                          + header.userCount * sizeof(SnapUser)
+                          + header.issuedCount * sizeof(SnapIssued) + search.termCount * sizeof(SnapTerm)
+                          + search.postingCount * sizeof(SnapPosting) + header.heapSize;
+        if(expected != file.size()) {
+            notice("Snapshot \"", filename, "\" is truncated.");
+            return false;
+        }
+        const SnapBook* bookRecs = reinterpret_cast<const SnapBook*>(base + sizeof(header) + searchSize);
+        const SnapUser* userRecs = reinterpret_cast<const SnapUser*>(base + sizeof(header) + searchSize + header.bookCount * bookSize);
+        const SnapIssued* issuedRecs = reinterpret_cast<const SnapIssued*>(userRecs + header.userCount);
+        const SnapTerm* termRecs = reinterpret_cast<const SnapTerm*>(issuedRecs + header.issuedCount);
+        const SnapPosting* postingRecs = reinterpret_cast<const SnapPosting*>(termRecs + search.termCount);
+        const char* heap = reinterpret_cast<const char*>(postingRecs + search.postingCount);
+        auto str = [&](const SnapString &ref) {
+            if(uint64_t(ref.offset) + ref.length > header.heapSize) return string();
+            return string(heap + ref.offset, ref.length);
+        };
+        // Version 1 books are widened into current records first; a status
+        // string that does not parse is kept as a bad status byte.
+        vector<SnapBook> widened;
+        if(header.version == 1) {
+            const SnapBookV1* oldRecs = reinterpret_cast<const SnapBookV1*>(bookRecs);
+            widened.resize(header.bookCount);
+            for(uint64_t i = 0; i < header.bookCount; ++i) {
+                const SnapBookV1 &old = oldRecs[i];
+                SnapBook &rec = widened[i];
+                rec.title = old.title;
+                rec.author = old.author;
+                rec.publisher = old.publisher;
+                rec.isbn = old.isbn;
+                rec.reservedBy = old.reservedBy;
+                rec.year = old.year;
+                BookStatus s;
+                rec.status = parseStatus(str(old.status), s) ? static_cast<uint8_t>(s) : numeric_limits<uint8_t>::max();
+                memset(rec.reserved, 0, sizeof(rec.reserved));
+                rec.reservationExpiry = old.reservationExpiry;
+            }
+            bookRecs = widened.data();
+        }
+        // A book's handle is its position, so a bad record cannot just be
+        // skipped: the books after it and their loans would shift.
+        for(uint64_t i = 0; i < header.bookCount; ++i)
+            if(bookRecs[i].status > static_cast<uint8_t>(BookStatus::Reserved)) {
+                notice("Snapshot \"", filename, "\" has a damaged book record.");
+                return false;
+            }
+        clearBooks();
+        for(uint64_t i = 0; i < header.bookCount; ++i) {
+            const SnapBook &rec = bookRecs[i];
+            books.emplace_back(str(rec.title), str(rec.author), str(rec.publisher), rec.year, str(rec.isbn),
+                               static_cast<BookStatus>(rec.status), str(rec.reservedBy),
+                               static_cast<time_t>(rec.reservationExpiry), &bookArena);
+        }
+        // The search index is derived from the books, so a damaged term
+        // table only costs the time to rebuild it.
+        bool searchRestored = header.version >= 4 &&
+            restoreSearch(termRecs, search.termCount, postingRecs, search.postingCount, heap, header.heapSize);
+        if(header.version >= 4 && !searchRestored)
+            notice("Snapshot \"", filename, "\" has a damaged search index; rebuilding it.");
+        rebuildBookIndex(!searchRestored);
+        clearUsers();
+        userIndex.reserve(header.userCount);
+        for(uint64_t i = 0; i < header.userCount; ++i) {
+            const SnapUser &rec = userRecs[i];
+            RoleId role;
+            if(header.version == 2) {
+                uint8_t legacy;
+                memcpy(&legacy, &rec.role, 1);
+                if(legacy >= size(snapshotV2Roles)) continue;
+                role = policies.named(snapshotV2Roles[legacy]);
+            } else if(!policies.findOrAdd(str(rec.role), role)) {
+                continue;
+            }
+            User* u = makeUser(str(rec.id), str(rec.name), str(rec.password), role, &userArena);
+            if(!u) continue;
+            u->getAccount().addFine(rec.fine);
+            if(!userIndex.emplace(u->getID(), u).second) {
+                releaseUser(u);
+                continue;
+            }
+            appendUser(u);
+        }
+        issued.clear();
+        issued.reserve(header.issuedCount);
+        for(uint64_t i = 0; i < header.issuedCount; ++i) {
+            const SnapIssued &rec = issuedRecs[i];
+            if(rec.book >= books.size()) continue;
+            issued.push_back(IssuedRecord { str(rec.userID), static_cast<BookHandle>(rec.book),
+                                            static_cast<time_t>(rec.issueTime) });
+        }
+        rebuildLoanIndexes();
+        METRIC_OUTCOME(timer, true);
+        notice("Loaded snapshot from \"", filename, "\"");
+        return true;
+    }
+    // Book segment n holds handles [n * booksPerSegment, (n + 1) *
+    // booksPerSegment), so every segment but the last must be full for the
+    // handles to come back the same; if one is not, everything is
+    // rewritten at the next checkpoint.
+    void loadSegments() {
+        clearBooks();
+        clearUsers();
+        issued.clear();
+        size_t bookSegments = 0;
+        bool aligned = true;
+        for(;; ++bookSegments) {
+            CsvReader reader(segmentPath("books", bookSegments));
+            if(!reader.isOpen()) break;
+            METRIC_TIMER(timer, LoadSegment);
+            aligned = aligned && books.size() == bookSegments * booksPerSegment;
+            readBooks(reader);
+            METRIC_BYTES(timer, reader.bytesRead());
+        }
+        rebuildBookIndex();
+        for(size_t s = 0; s < userSegmentCount; ++s) {
+            CsvReader reader(segmentPath("users", s));
+            if(!reader.isOpen()) continue;
+            METRIC_TIMER(timer, LoadSegment);
+            readUsers(reader);
+            METRIC_BYTES(timer, reader.bytesRead());
+        }
+        for(size_t s = 0; s < bookSegments; ++s) {
+            CsvReader reader(segmentPath("issued", s));
+            if(!reader.isOpen()) continue;
+            METRIC_TIMER(timer, LoadSegment);
+            readIssued(reader);
+            METRIC_BYTES(timer, reader.bytesRead());
+        }
+        rebuildLoanIndexes();
+        if(!aligned || books.size() > bookSegments * booksPerSegment) {
+            notice("Book segments in \"", segmentDirectory, "\" are out of line; all segments will be rewritten.");
+            rewriteAllSegments = true;
+        }
+        notice("Loaded books, users and issued records from \"", segmentDirectory, "\"");
+    }
+    // books.csv, users.csv and issued.csv, as written by earlier versions,
+    // --generate and --snapshot-to-csv, are read in preference to data/
+    // and moved into it by the next checkpoint.
+    void loadTables() {
+        error_code error;
+        if(filesystem::exists("books.csv", error)) {
+            loadBooks("books.csv");
+            loadUsers("users.csv");
+            loadIssued("issued.csv");
+            rewriteAllSegments = true;
+        } else if(filesystem::is_directory(segmentDirectory, error)) {
+            loadSegments();
+        } else {
+            notice("No saved library found. It will be created in \"", segmentDirectory, "\" on saving.");
+            rewriteAllSegments = true;
+        }
+    }
+    struct Segment {
+        size_t index;
+        string rows;
+    };
+    vector<Segment> renderUserSegments(const vector<size_t> &wanted) const {
+        vector<Segment> out;
+        vector<Segment*> bySegment(userSegmentCount, nullptr);
+        out.reserve(wanted.size());
+        for(size_t s : wanted) {
+            out.push_back(Segment { s, string() });
+            bySegment[s] = &out.back();
+        }
+        if(out.empty()) return out;
+        for(const User* u : users) {
+            Segment* segment = bySegment[userSegment(u->getID())];
+            if(!segment) continue;
+            lock_guard<mutex> lock(userStripe(u->getID()));
+            segment->rows += u->toCSV();
+            segment->rows += '\n';
+        }
+        return out;
+    }
+    // An empty user or loan segment is removed rather than written.
+    bool saveSegments(const char* table, const vector<Segment> &segments, bool announce) const {
+        bool saved = true;
+        for(const Segment &segment : segments) {
+            string path = segmentPath(table, segment.index);
+            METRIC_TIMER(timer, SaveSegment);
+            METRIC_BYTES(timer, segment.rows.size());
+            bool written;
+            if(segment.rows.empty()) {
+                error_code error;
+                filesystem::remove(path, error);
+                written = !error;
+            } else {
+                written = replaceFile(path, segment.rows);
+            }
+            METRIC_OUTCOME(timer, written);
+            if(!written) {
+                notice("Error writing to \"", path, "\"");
+                saved = false;
+            }
+        }
+        if(announce && !segments.empty())
+            notice("Saved ", segments.size(), " ", table, segments.size() == 1 ? " segment" : " segments",
+                   " to \"", segmentDirectory, "\"");
+        return saved;
+    }
+    // After every segment has been written: segments past the end of the
+    // catalog and the single CSV files are no longer read. books.csv goes
+    // first, since it is what makes loadTables prefer the other two.
+    void retireOldFiles(size_t bookSegments) {
+        error_code error;
+        for(size_t s = bookSegments; filesystem::remove(segmentPath("books", s), error); ++s)
+            filesystem::remove(segmentPath("issued", s), error);
+        if(filesystem::remove("books.csv", error))
+            notice("Moved books.csv, users.csv and issued.csv into \"", segmentDirectory, "\"");
+        filesystem::remove("users.csv", error);
+        filesystem::remove("issued.csv", error);
+    }
+    // A checkpoint in two halves: beginCheckpoint needs checkpointLock and
+    // structureLock (shared is enough), finishCheckpoint only
+    // checkpointLock. The old journal is only deleted once everything it
+    // covers is on disk. A failed write leaves the segments it took clean,
+    // so the next checkpoint rewrites them all.
+    struct CheckpointImage {
+        bool snapshot = false;
+        bool journalOnly = false;   // snapshot mode, with the snapshot left as it is
+        string snapshotImage;
+        bool allSegments = false;
+        size_t bookSegments = 0;
+        vector<Segment> books, users, issued;
+        vector<LoanHistoryRecord> history;
+    };
+    CheckpointImage beginCheckpoint() {
+        size_t rotated = rotateJournal();
+        CheckpointImage image;
+        {
+            lock_guard<mutex> lock(historyLock);
+            image.history.swap(historyPending);
+            historyInFlight = image.history;
+        }
+        image.snapshot = snapshotMode;
+        if(snapshotMode) {
+            journalSinceSnapshot += rotated;
+            if(journalSinceSnapshot * snapshotRebuildShare < books.size() + users.size()) {
+                image.journalOnly = true;
+                return image;
+            }
+            journalSinceSnapshot = 0;
+            image.snapshotImage = renderSnapshot();
+            return image;
+        }
+        image.allSegments = rewriteAllSegments;
+        rewriteAllSegments = false;
+        if(image.allSegments) {
+            dirtyBooks.markAll();
+            dirtyIssued.markAll();
+            dirtyUsers.markAll();
+        }
+        image.bookSegments = dirtyBooks.size();
+        for(size_t s : dirtyBooks.take())
+            image.books.push_back(Segment { s, renderBooks(s * booksPerSegment, (s + 1) * booksPerSegment) });
+        for(size_t s : dirtyIssued.take())
+            image.issued.push_back(Segment { s, renderIssued(s * booksPerSegment, (s + 1) * booksPerSegment) });
+        image.users = renderUserSegments(dirtyUsers.take());
+        return image;
+    }
+    bool finishCheckpoint(const CheckpointImage &image, bool announce) {
+        METRIC_TIMER(timer, Checkpoint);
+        bool saved;
+        if(image.journalOnly) {
+            saved = true;
+        } else if(image.snapshot) {
+            saved = saveSnapshot(snapshotFile, image.snapshotImage, announce);
+        } else {
+            error_code error;
+            filesystem::create_directories(segmentDirectory, error);
+            saved = saveSegments("books", image.books, announce);
+            saved = saveSegments("users", image.users, announce) && saved;
+            saved = saveSegments("issued", image.issued, announce) && saved;
+            if(!saved)
+                rewriteAllSegments = true;
+            else if(image.allSegments)
+                retireOldFiles(image.bookSegments);
+        }
+        size_t archived = history.append(image.history);
+        {
+            lock_guard<mutex> lock(historyLock);
+            historyPending.insert(historyPending.begin(), image.history.begin() + archived, image.history.end());
+            historyInFlight.clear();
+        }
+        if(archived < image.history.size()) {
+            notice("Error writing the loan history");
+            saved = false;
+        }
+        METRIC_OUTCOME(timer, saved);
+        if(saved && !image.journalOnly)
+            remove(previousJournalFile.c_str());
+        return saved;
+    }
+    bool checkpoint() {
+        return finishCheckpoint(beginCheckpoint(), true);
+    }
+    bool checkpointPending() const {
+        error_code error;
+        return journalRecords > 0 || rewriteAllSegments || (!snapshotMode && filesystem::exists(previousJournalFile, error));
+    }
+public:
+    // A snapshot that exists but cannot be read is fatal. The tables are
+    // older than it, and the checkpoint after the replay would write them
+    // out over the changes kept in journal.prev.
+    bool loadAllData() {
+        lock_guard<mutex> serial(checkpointLock);
+        unique_lock<shared_mutex> structure(structureLock);
+        loadPolicies();
+        error_code error;
+        bool haveSnapshot = filesystem::exists(snapshotFile, error);
+        snapshotMode = haveSnapshot && loadSnapshot(snapshotFile);
+        if(haveSnapshot && !snapshotMode) {
+            notice("Snapshot \"", snapshotFile, "\" could not be loaded. Nothing was changed; restore it from a backup,",
+                   " or delete it to start from the CSV files without the changes made since it was written.");
+            return false;
+        }
+        if(!snapshotMode)
+            loadTables();
+        if(size_t torn = history.load())
+            notice("Cut off ", torn, " damaged block(s) at the end of the loan history");
+        historyPending.clear();
+        size_t replayed = replayJournal(previousJournalFile) + replayJournal(journalFile);
+        journalSinceSnapshot = snapshotMode ? replayed : 0;
+        // Returns from several desks can reach the journal out of order.
+        sort(historyPending.begin(), historyPending.end(), [](const LoanHistoryRecord &a, const LoanHistoryRecord &b) {
+            return a.sequence < b.sequence;
+        });
+        historySequence = historyPending.empty() ? history.lastSequence() : historyPending.back().sequence;
+        if(replayed > 0) {
+            notice("Replayed ", replayed, " journal records");
+            checkpoint();
+        }
+        rebuildAccounts();
+        rebuildHoldTimers();
+        expireHolds(time(0));
+        sweepOverdue(time(0));
+        return true;
+    }
+    // Every change goes through the journal, so an empty journal means the
+    // files on disk are already current.
+    bool saveAllData() {
+        lock_guard<mutex> serial(checkpointLock);
+        unique_lock<shared_mutex> structure(structureLock);
+        return !checkpointPending() || checkpoint();
+    }
+    // Offline conversion between the CSV files and library.snap.
+    bool convertCSVToSnapshot() {
+        unique_lock<shared_mutex> structure(structureLock);
+        loadTables();
+        return saveSnapshot(snapshotFile, renderSnapshot());
+    }
+    // journal.prev holds the changes made since the snapshot was written,
+    // so they are replayed onto it first.
+    bool convertSnapshotToCSV() {
+        unique_lock<shared_mutex> structure(structureLock);
+        if(!loadSnapshot(snapshotFile)) {
+            notice("Snapshot \"", snapshotFile, "\" could not be loaded.");
+            return false;
+        }
+        replayJournal(previousJournalFile);
+        replayJournal(journalFile);
+        bool saved = saveBooks("books.csv", renderBooks());
+        saved = saveUsers("users.csv", renderUsers()) && saved;
+        return saveIssued("issued.csv", renderIssued()) && saved;
+    }
+    ~Library() {
+        stopCheckpointer();
+        commit();
+        clearUsers();
+    }
+};
+
+const size_t listPageSize = 20;
+
+void runOverdueSweepAndReport(Library &lib, const string &reportFile) {
+    OverdueSummary summary = lib.runOverdueSweep(time(0));
+    cout << summary.overdue.size() << " of " << summary.openLoans << " open loans are overdue; "
+         << summary.totalAccrued << " rupees in fines are building up.\n";
+    if(lib.writeOverdueReport(summary, reportFile))
+        cout << "Overdue report written to \"" << reportFile << "\"\n";
+}
+
+void reportIssue(const OpResult &result, const string &uid, const string &isbn) {
+    if(result.status == OpStatus::Ok)
+        cout << "Book (ISBN " << isbn << ") issued to user " << uid << ".\n";
+    else
+        cout << opStatusMessage(result.status) << "\n";
+}
+
+void reportReturn(const OpResult &result, int daysBorrowed) {
+    if(result.status != OpStatus::Ok) {
+        cout << opStatusMessage(result.status) << "\n";
+        return;
+    }
+    if(result.fine > 0)
+        cout << "Book returned after " << daysBorrowed << " days. Fine of " << result.fine << " rupees applied.\n";
+    else
+        cout << "Book returned successfully.\n";
+    if(!result.heldFor.empty())
+        cout << "Book is now reserved exclusively for user " << result.heldFor << " for " << result.holdDays << " days.\n";
+}
+
+void reportReservation(const OpResult &result) {
+    if(result.status != OpStatus::Ok)
+        cout << opStatusMessage(result.status) << "\n";
+    else if(result.queuePosition == 1)
+        cout << "Book reserved successfully. Once returned, it will be available exclusively for you for "
+             << result.holdDays << " days.\n";
+    else
+        cout << "Book reserved. You are number " << result.queuePosition << " in the reservation queue.\n";
+}
+
+void showBorrowedBooks(Library &lib, const User* user) {
+    string out;
+    if(lib.formatBorrowedBooks(user, out) == 0) {
+        cout << "You have not borrowed any books.\n";
+        return;
+    }
+    size_t overdue = lib.overdueLoansOf(user, time(0)).size();
+    if(overdue > 0)
+        out += to_string(overdue) + " of these books are past their due date.\n";
+    cout << out;
+}
+
+bool nextPagePrompt() {
+    string more;
+    cout << "Enter n for the next page, anything else to stop: ";
+    cin >> more;
+    return more == "n";
+}
+
+bool readYear(const string &prompt, int &year) {
+    cout << prompt;
+    if(!(cin >> year)) {
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Invalid year.\n";
+        return false;
+    }
+    return true;
+}
+
+bool readBookFilter(BookFilter &filter) {
+    string text;
+    cout << "Status (Available/Borrowed/Reserved, or any): ";
+    cin >> text;
+    if(text != "any") {
+        if(!parseStatus(text, filter.status)) {
+            cout << "Invalid status.\n";
+            return false;
+        }
+        filter.byStatus = true;
+    }
+    int year;
+    if(!readYear("Earliest year (0 for any): ", year)) return false;
+    if(year != 0) filter.minYear = year;
+    if(!readYear("Latest year (0 for any): ", year)) return false;
+    if(year != 0) filter.maxYear = year;
+    cout << "Author contains (blank for any): ";
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    getline(cin, filter.author);
+    return true;
+}
+
+// Local midnight at the start of a YYYY-MM-DD date.
+bool parseDate(const string &text, time_t &t) {
+    tm day {};
+    char extra;
+    if(sscanf(text.c_str(), "%d-%d-%d%c", &day.tm_year, &day.tm_mon, &day.tm_mday, &extra) != 3)
+        return false;
+    day.tm_year -= 1900;
+    day.tm_mon -= 1;
+    day.tm_isdst = -1;
+    t = mktime(&day);
+    return t != -1;
+}
+
+time_t startOfMonth(time_t now) {
+    tm month = localTime(now);
+    month.tm_mday = 1;
+    month.tm_hour = month.tm_min = month.tm_sec = 0;
+    month.tm_isdst = -1;
+    return mktime(&month);
+}
+
+// Report values are counts or percentages; %g would turn large counts
+// into exponents.
+string formatReportValue(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", value);
+    return buf;
+}
+
+// Prints a report page by page, each column padded to its widest entry.
+void printReport(const Report &report) {
+    if(report.rows.empty()) {
+        cout << "No matching books found.\n";
+        return;
+    }
+    vector<vector<string>> cells { report.columns };
+    for(const ReportRow &row : report.rows) {
+        cells.push_back({ row.label });
+        for(double value : row.values)
+            cells.back().push_back(formatReportValue(value));
+    }
+    vector<size_t> widths(report.columns.size());
+    for(const vector<string> &line : cells)
+        for(size_t c = 0; c < line.size(); ++c)
+            widths[c] = max(widths[c], line[c].size());
+    auto print = [&](const vector<string> &line) {
+        string out = line[0] + string(widths[0] - line[0].size(), ' ');
+        for(size_t c = 1; c < line.size(); ++c)
+            out += string(widths[c] - line[c].size() + 2, ' ') + line[c];
+        cout << out << '\n';
+    };
+    print(cells[0]);
+    for(size_t r = 1; r < cells.size(); ++r) {
+        print(cells[r]);
+        if(r % listPageSize == 0 && r + 1 < cells.size() && !nextPagePrompt())
+            break;
+    }
+}
+
+void reportsMenu(Library &lib) {
+    int choice;
+    cout << "\n--- Reports ---\n";
+    cout << "1. Loans per Author This Month\n";
+    cout << "2. Utilization by Publication Year\n";
+    cout << "3. Collection by Publisher\n";
+    cout << "Enter your choice: ";
+    if(!(cin >> choice) || choice < 1 || choice > 3) {
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Invalid choice.\n";
+        return;
+    }
+    BookFilter filter;
+    string answer;
+    cout << "Filter the books? (y/n): ";
+    cin >> answer;
+    if(answer == "y" && !readBookFilter(filter))
+        return;
+    cout << "\n";
+    printReport(lib.report(static_cast<ReportKind>(choice - 1), filter, startOfMonth(time(0))));
+}
+
+void formatHistoryRecord(const LoanHistoryRecord &r, string &out) {
+    char issued[32], returned[32];
+    tm local = localTime(r.issueTime);
+    strftime(issued, sizeof(issued), "%Y-%m-%d", &local);
+    local = localTime(r.returnTime);
+    strftime(returned, sizeof(returned), "%Y-%m-%d", &local);
+    out += "User ID: "; out += r.userID;
+    out += ", ISBN: "; out += r.isbn;
+    out += ", Issued: "; out += issued;
+    out += ", Returned: "; out += returned;
+    out += ", Fine: "; out += formatAmount(r.fine);
+    out += '\n';
+}
+
+void loanHistoryMenu(Library &lib) {
+    HistoryQuery query;
+    string from, to;
+    cout << "ISBN (blank for any): ";
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    getline(cin, query.isbn);
+    cout << "User ID (blank for any): ";
+    getline(cin, query.userID);
+    cout << "From date YYYY-MM-DD (blank for any): ";
+    getline(cin, from);
+    cout << "To date YYYY-MM-DD (blank for any): ";
+    getline(cin, to);
+    if((!from.empty() && !parseDate(from, query.from)) || (!to.empty() && !parseDate(to, query.to))) {
+        cout << "Invalid date.\n";
+        return;
+    }
+    if(!to.empty())
+        query.to += 24 * 3600 - 1;
+    size_t unreadable;
+    vector<LoanHistoryRecord> loans = lib.loanHistory(query, unreadable);
+    cout << "\n--- Loan History ---\n";
+    if(loans.empty()) {
+        cout << "No matching loans found.\n";
+        return;
+    }
+    for(size_t i = 0; i < loans.size(); i += listPageSize) {
+        string page;
+        for(size_t j = i; j < min(loans.size(), i + listPageSize); ++j)
+            formatHistoryRecord(loans[j], page);
+        cout << page;
+        if(i + listPageSize >= loans.size() || !nextPagePrompt())
+            break;
+    }
+}
+
+void browseBooksMenu(Library &lib, const string &currentUserID) {
+    BookFilter filter;
+    string answer;
+    cout << "Filter the list? (y/n): ";
+    cin >> answer;
+    if(answer == "y" && !readBookFilter(filter))
+        return;
+    cout << "\n--- All Books ---\n";
+    BookHandle cursor = 0;
+    bool any = false;
+    while(true) {
+        string page;
+        cursor = lib.formatBooks(filter, cursor, listPageSize, currentUserID, page);
+        any = any || !page.empty();
+        cout << page;
+        if(cursor == noBook || !nextPagePrompt())
+            break;
+    }
+    if(!any)
+        cout << "No matching books found.\n";
+}
+
+void browseUsersMenu(Library &lib) {
+    cout << "\n--- All Users ---\n";
+    uint64_t cursor = 0;
+    while(true) {
+        string page;
+        cursor = lib.formatUsers(cursor, listPageSize, page);
+        cout << page;
+        if(cursor == endOfUsers || !nextPagePrompt())
+            break;
+    }
+}
+
+void browseBorrowingDetailsMenu(Library &lib) {
+    cout << "\n--- Borrowing Details ---\n";
+    if(lib.getIssuedCount() == 0) {
+        cout << "No books are currently issued.\n";
+        return;
+    }
+    size_t cursor = 0;
+    while(true) {
+        string page;
+        cursor = lib.formatIssued(cursor, listPageSize, page);
+        cout << page;
+        if(cursor >= lib.getIssuedCount() || !nextPagePrompt())
+            break;
+    }
+}
+
+void searchCatalogMenu(Library &lib, const string &currentUserID) {
+    const size_t pageSize = 10;
+    string query;
+    cout << "Enter search terms (title, author or publisher): ";
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    getline(cin, query);
+    size_t offset = 0;
+    while(true) {
+        CatalogSearch::Results results = lib.searchCatalog(query, offset, pageSize);
+        if(results.total == 0) {
+            cout << "No matching books found.\n";
+            return;
+        }
+        cout << "\n--- Results " << offset + 1 << "-" << offset + results.hits.size()
+             << " of " << results.total << " ---\n";
+        string page;
+        for(BookHandle h : results.hits)
+            lib.formatBook(h, currentUserID, page);
+        cout << page;
+        if(offset + pageSize >= results.total || !nextPagePrompt())
+            return;
+        offset += pageSize;
+    }
+}
+
+// Menu for every role that is not a librarian. Roles that are never
+// fined do not see the fine options.
+void patronMenu(Library &lib, User* user) {
+    enum Item { Browse, Borrow, Reserve, Return, ShowFine, ClearFine, Borrowed, Search, Logout };
+    static const char* const labels[] = {
+        "View All Books", "Borrow Book", "Reserve Book", "Return Book", "View Outstanding Fine",
+        "Request Fine Clearance", "View Currently Borrowed Books", "Search Catalog", "Logout"
+    };
+    const BorrowingPolicy &policy = user->getPolicy();
+    vector<Item> items = { Browse, Borrow, Reserve, Return };
+    if(policy.finePerDay > 0)
+        items.insert(items.end(), { ShowFine, ClearFine });
+    items.insert(items.end(), { Borrowed, Search, Logout });
+    int choice;
+    while (true) {
+        cout << "\n--- " << policy.role << " Menu (" << user->getName() << ") ---\n";
+        for(size_t i = 0; i < items.size(); ++i)
+            cout << i + 1 << ". " << labels[items[i]] << "\n";
+        cout << "Enter your choice: ";
+        if(!(cin >> choice)) {
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "Invalid input. Try again.\n";
+            continue;
+        }
+        if(choice < 1 || choice > static_cast<int>(items.size())) {
+            cout << "Invalid choice. Please try again.\n";
+            continue;
+        }
+        Item item = items[choice - 1];
+        if(item == Logout) break;
+        switch(item) {
+            case Browse:
+                browseBooksMenu(lib, user->getID());
+                break;
+            case Borrow:
+                if(user->getAccount().getFine() > 0 ||
+                   (policy.clearanceBlocks && user->getAccount().isFineSettlementPending())){
+                    cout << "Cannot borrow new books until outstanding fines are cleared.\n";
+                } else {
+                    {
+                      string isbn;
+                      cout << "Enter ISBN to borrow: ";
+                      cin >> isbn;
+                      reportIssue(lib.issueBook(user->getID(), isbn), user->getID(), isbn);
+                    }
+                }
+                break;
+            case Reserve:
+                {
+                    string isbn;
+                    cout << "Enter ISBN to reserve: ";
+                    cin >> isbn;
+                    reportReservation(lib.reserveBook(user->getID(), isbn));
+                }
+                break;
+            case Return:
+                {
+                    string isbn;
+                    int days;
+                    cout << "Enter ISBN to return: ";
+                    cin >> isbn;
+                    cout << "Enter number of days since issue: ";
+                    cin >> days;
+                    reportReturn(lib.returnBook(user->getID(), isbn, days), days);
+                }
+                break;
+            case ShowFine:
+                cout << "Outstanding fine: " << user->getAccount().getFine() << " rupees\n";
+                if(user->getAccount().getAccruedFine() > 0)
+                    cout << "Fines building up on overdue books: " << user->getAccount().getAccruedFine()
+                         << " rupees (charged when returned)\n";
+                break;
+            case ClearFine:
+                switch(lib.requestFineClearance(user->getID())) {
+                    case OpStatus::Ok:
+                        cout << "Your fine clearance request has been sent for librarian approval.\n";
+                        break;
+                    case OpStatus::SettlementPending:
+                        cout << "Your fine clearance request is pending approval.\n";
+                        break;
+                    default:
+                        cout << "No fine to clear.\n";
+                }
+                break;
+            case Borrowed:
+                showBorrowedBooks(lib, user);
+                break;
+            case Search:
+                searchCatalogMenu(lib, user->getID());
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void librarianMenu(Library &lib, User* user) {
+    int choice;
+    while (true) {
+        cout << "\n--- Librarian Menu (" << user->getName() << ") ---\n";
+        cout << "1. Add Book\n";
+        cout << "2. Add User\n";
+        cout << "3. Remove User\n";
+        cout << "4. Search Book by ISBN\n";
+        cout << "5. List All Books\n";
+        cout << "6. View Borrowing Details\n";
+        cout << "7. List All Users\n";
+        cout << "8. Approve Fine Clearance for a User\n";
+        cout << "9. Search Catalog\n";
+        cout << "10. Run Overdue Sweep\n";
+        cout << "11. Reports\n";
+        cout << "12. Loan History\n";
+        cout << "13. Logout\n";
+        cout << "Enter your choice: ";
+        if(!(cin >> choice)) {
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "Invalid input. Try again.\n";
+            continue;
+        }
+        if(choice == 13) break;
+        switch(choice) {
+            case 1:
+                {
+                    string title, author, publisher, isbn;
+                    int year;
+                    cout << "Enter title: ";
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    getline(cin, title);
+                    cout << "Enter author: ";
+                    getline(cin, author);
+                    cout << "Enter publisher: ";
+                    getline(cin, publisher);
+                    cout << "Enter year: ";
+                    cin >> year;
+                    cout << "Enter ISBN: ";
+                    cin >> isbn;
+                    if(lib.searchBookByISBN(isbn) != nullptr) {
+                        cout << "Book with ISBN " << isbn << " already exists. Cannot add duplicate.\n";
+                    } else {
+                        Book newBook(title, author, publisher, year, isbn);
+                        if(lib.addNewBook(newBook) == OpStatus::Ok)
+                            cout << "Book added successfully.\n";
+                        else
+                            cout << "Book with ISBN " << isbn << " already exists. Cannot add duplicate.\n";
+                    }
+                }
+                break;
+            case 2:
+                {
+                    string uid, uname, upass, roleText;
+                    cout << "Enter new User ID: ";
+                    cin >> uid;
+                    if(lib.getUserById(uid) != nullptr) {
+                        cout << "User with ID " << uid << " already exists. Cannot add duplicate.\n";
+                        break;
+                    }
+                    cout << "Enter name: ";
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    getline(cin, uname);
+                    cout << "Enter password: ";
+                    cin >> upass;
+                    string patronRoles;
+                    for(size_t r = 0; r < policies.size(); ++r) {
+                        if(policies[r].librarian) continue;
+                        if(!patronRoles.empty()) patronRoles += '/';
+                        patronRoles += policies[r].role;
+                    }
+                    cout << "Enter role (" << patronRoles << "): ";
+                    cin >> roleText;
+                    RoleId role;
+                    if(!policies.find(roleText, role) || policies[role].librarian) {
+                        cout << "Invalid role. Only " << patronRoles << " allowed.\n";
+                        break;
+                    }
+                    User* newUser = makeUser(uid, uname, hashPassword(upass), role);
+                    if(lib.addNewUser(newUser) == OpStatus::Ok)
+                        cout << "User added successfully.\n";
+                    else
+                        cout << "User with ID " << uid << " already exists. Cannot add duplicate.\n";
+                }
+                break;
+            case 3:
+                {
+                    string uid;
+                    cout << "Enter User ID to remove: ";
+                    cin >> uid;
+                    OpStatus status = lib.removeUserIfPossible(uid);
+                    if(status == OpStatus::Ok)
+                        cout << "User " << uid << " removed successfully.\n";
+                    else if(status == OpStatus::HasLoans)
+                        cout << "Cannot remove user " << uid << " because they have borrowed books.\n";
+                    else
+                        cout << "User not found.\n";
+                }
+                break;
+            case 4:
+                {
+                    string isbn;
+                    cout << "Enter ISBN to search: ";
+                    cin >> isbn;
+                    string details;
+                    if(lib.formatBook(lib.findBook(isbn), "", details))
+                        cout << details;
+                    else
+                        cout << "Book not found.\n";
+                }
+                break;
+            case 5:
+                browseBooksMenu(lib, user->getID());
+                break;
+            case 6:
+                browseBorrowingDetailsMenu(lib);
+                break;
+            case 7:
+                browseUsersMenu(lib);
+                break;
+            case 8:
+                {
+                    string uid;
+                    cout << "Enter User ID to approve fine clearance: ";
+                    cin >> uid;
+                    if(lib.approveFineClearance(uid) == OpStatus::Ok) {
+                        cout << "Fine for user " << uid << " has been approved and cleared.\n";
+                    } else {
+                        cout << "No pending fine clearance for this user or user not found.\n";
+                    }
+                }
+                break;
+            case 9:
+                searchCatalogMenu(lib, user->getID());
+                break;
+            case 10:
+                runOverdueSweepAndReport(lib, "overdue_report.csv");
+                break;
+            case 11:
+                reportsMenu(lib);
+                break;
+            case 12:
+                loanHistoryMenu(lib);
+                break;
+            default:
+                cout << "Invalid choice. Please try again.\n";
+                break;
+        }
+    }
+}
+
+User* login(Library &lib) {
+    string uid, pass;
+    cout << "Enter User ID: ";
+    cin >> uid;
+    cout << "Enter Password: ";
+    cin >> pass;
+    OpStatus status = lib.authenticate(uid, pass);
+    if(status != OpStatus::Ok) {
+        cout << opStatusMessage(status) << "\n";
+        return nullptr;
+    }
+    return lib.getUserById(uid);
+}
+
+// --export <books|users|issued> <file> [status=S] [years=FROM-TO] [author=TEXT]
+// The filters apply to books only.
+// Reads key=value book filters from argv[first...]. A key it does not
+// know is left to other, if given, and rejected otherwise.
+bool parseFilterArgs(int argc, char* argv[], int first, BookFilter &filter,
+                     function<bool(const string &, const string &)> other = nullptr) {
+    for(int i = first; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq), value = eq == string::npos ? "" : arg.substr(eq + 1);
+        size_t dash = value.find('-');
+        if(key == "status" && parseStatus(value, filter.status)) {
+            filter.byStatus = true;
+        } else if(key == "years" && dash != string::npos
+                  && parseNumber(string_view(value).substr(0, dash), filter.minYear)
+                  && parseNumber(string_view(value).substr(dash + 1), filter.maxYear)) {
+        } else if(key == "author") {
+            filter.author = value;
+        } else if(!other || !other(key, value)) {
+            cout << "Invalid filter " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int runExport(Library &lib, int argc, char* argv[]) {
+    if(argc < 4) {
+        cout << "Usage: " << argv[0] << " --export <books|users|issued> <file> [status=S] [years=FROM-TO] [author=TEXT]\n";
+        return 1;
+    }
+    string what = argv[2];
+    BookFilter filter;
+    if(!parseFilterArgs(argc, argv, 4, filter))
+        return 1;
+    if(!lib.loadAllData())
+        return 1;
+    ofstream outFile(argv[3], ios::binary | ios::trunc);
+    if(!outFile) {
+        cout << "Error writing to \"" << argv[3] << "\"\n";
+        return 1;
+    }
+    if(what == "books")
+        lib.exportBooks(outFile, filter);
+    else if(what == "users")
+        lib.exportUsers(outFile);
+    else if(what == "issued")
+        lib.exportIssued(outFile);
+    else {
+        cout << "Unknown export " << what << "\n";
+        return 1;
+    }
+    cout << "Exported " << what << " to \"" << argv[3] << "\"\n";
+    return 0;
+}
+
+// Writes one of the reports as CSV. Loans per author counts loans issued
+// since the start of the month unless since=YYYY-MM-DD says otherwise.
+int runReport(Library &lib, int argc, char* argv[]) {
+    static const char* names[] = { "loans-by-author", "utilization-by-year", "by-publisher" };
+    size_t kind = 0;
+    while(argc >= 4 && kind < 3 && argv[2] != string(names[kind]))
+        ++kind;
+    if(argc < 4 || kind == 3) {
+        cout << "Usage: " << argv[0] << " --report <loans-by-author|utilization-by-year|by-publisher> <file>"
+             << " [status=S] [years=FROM-TO] [author=TEXT] [since=YYYY-MM-DD]\n";
+        return 1;
+    }
+    BookFilter filter;
+    time_t since = startOfMonth(time(0));
+    auto parseSince = [&](const string &key, const string &value) {
+        return key == "since" && parseDate(value, since);
+    };
+    if(!parseFilterArgs(argc, argv, 4, filter, parseSince))
+        return 1;
+    if(!lib.loadAllData())
+        return 1;
+    Report report = lib.report(static_cast<ReportKind>(kind), filter, since);
+    string out;
+    for(size_t c = 0; c < report.columns.size(); ++c) {
+        if(c) out += ',';
+        out += csvField(report.columns[c]);
+    }
+    out += '\n';
+    for(const ReportRow &row : report.rows) {
+        out += csvField(row.label);
+        for(double value : row.values) {
+            out += ',';
+            out += formatReportValue(value);
+        }
+        out += '\n';
+    }
+    ofstream outFile(argv[3], ios::binary | ios::trunc);
+    outFile << out;
+    if(!outFile) {
+        cout << "Error writing to \"" << argv[3] << "\"\n";
+        return 1;
+    }
+    cout << "Wrote " << report.rows.size() << " rows to \"" << argv[3] << "\"";
+    if(!report.complete) {
+        cout << ", missing the loans in the unreadable history blocks.\n";
+        return 1;
+    }
+    cout << "\n";
+    return 0;
+}
+
+// Writes the closed loans matching the filters as CSV.
+int runHistory(Library &lib, int argc, char* argv[]) {
+    if(argc < 3) {
+        cout << "Usage: " << argv[0] << " --history <file> [isbn=ISBN] [user=ID] [from=YYYY-MM-DD] [to=YYYY-MM-DD]\n";
+        return 1;
+    }
+    HistoryQuery query;
+    for(int i = 3; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq), value = eq == string::npos ? "" : arg.substr(eq + 1);
+        if(key == "isbn") {
+            query.isbn = value;
+        } else if(key == "user") {
+            query.userID = value;
+        } else if(key == "from" && parseDate(value, query.from)) {
+        } else if(key == "to" && parseDate(value, query.to)) {
+            query.to += 24 * 3600 - 1;
+        } else {
+            cout << "Invalid filter " << arg << "\n";
+            return 1;
+        }
+    }
+    if(!lib.loadAllData())
+        return 1;
+    size_t unreadable;
+    vector<LoanHistoryRecord> loans = lib.loanHistory(query, unreadable);
+    string out = "sequence,userID,isbn,issueTime,returnTime,fine\n";
+    for(const LoanHistoryRecord &r : loans) {
+        out += to_string(r.sequence); out += ',';
+        out += csvField(r.userID); out += ',';
+        out += csvField(r.isbn); out += ',';
+        out += to_string(r.issueTime); out += ',';
+        out += to_string(r.returnTime); out += ',';
+        out += formatAmount(r.fine); out += '\n';
+    }
+    ofstream outFile(argv[2], ios::binary | ios::trunc);
+    outFile << out;
+    if(!outFile) {
+        cout << "Error writing to \"" << argv[2] << "\"\n";
+        return 1;
+    }
+    cout << "Wrote " << loans.size() << " loans to \"" << argv[2] << "\"";
+    if(unreadable > 0) {
+        cout << ", missing those in the unreadable blocks.\n";
+        return 1;
+    }
+    cout << "\n";
+    return 0;
+}
+
+// Applies a file of circulation operations as one batch. Each line is
+//   issue,<userID>,<isbn> | return,<userID>,<isbn>,<days> | reserve,<userID>,<isbn>
+// and gets a row in the results file with its outcome.
+int runBulkImport(Library &lib, const string &opsFile, const string &resultsFile) {
+    CsvReader reader(opsFile);
+    if(!reader.isOpen()) {
+        cout << "Operations file \"" << opsFile << "\" not found.\n";
+        return 1;
+    }
+    if(!lib.loadAllData())
+        return 1;
+    vector<BatchOp> ops;
+    vector<size_t> lines;
+    CsvRow row;
+    string_view line;
+    size_t lineNumber = 0, skipped = 0;
+    while(reader.nextLine(line)) {
+        ++lineNumber;
+        if(line.empty()) continue;
+        BatchOp op;
+        bool valid = row.parse(line) && row.size() >= 3;
+        if(valid && row[0] == "issue") op.kind = OpKind::Issue;
+        else if(valid && row[0] == "reserve") op.kind = OpKind::Reserve;
+        else if(valid && row[0] == "return" && row.size() >= 4 && parseNumber(row[3], op.daysBorrowed))
+            op.kind = OpKind::Return;
+        else valid = false;
+        if(!valid) {
+            cout << "Skipping line " << lineNumber << " of \"" << opsFile << "\": not a valid operation.\n";
+            ++skipped;
+            continue;
+        }
+        op.userID.assign(row[1]);
+        op.isbn.assign(row[2]);
+        ops.push_back(std::move(op));
+        lines.push_back(lineNumber);
+    }
+    auto started = chrono::steady_clock::now();
+    vector<OpResult> results = lib.applyBatch(ops);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    static const char* kindNames[] = { "issue", "return", "reserve" };
+    map<string, size_t> counts;
+    string buffer = "line,operation,userID,isbn,status,fine\n";
+    for(size_t i = 0; i < ops.size(); ++i) {
+        const char* status = opStatusName(results[i].status);
+        ++counts[status];
+        buffer += to_string(lines[i]); buffer += ',';
+        buffer += kindNames[static_cast<int>(ops[i].kind)]; buffer += ',';
+        buffer += csvField(ops[i].userID); buffer += ',';
+        buffer += csvField(ops[i].isbn); buffer += ',';
+        buffer += status; buffer += ',';
+        buffer += formatAmount(results[i].fine); buffer += '\n';
+    }
+    ofstream outFile(resultsFile, ios::binary | ios::trunc);
+    if(!outFile) {
+        cout << "Error writing to \"" << resultsFile << "\"\n";
+        return 1;
+    }
+    outFile << buffer;
+    cout << "Applied " << ops.size() << " operations in " << seconds << " s";
+    if(skipped > 0)
+        cout << " (" << skipped << " invalid lines skipped)";
+    cout << ":";
+    for(const auto &entry : counts)
+        cout << " " << entry.first << "=" << entry.second;
+    cout << "\nResults written to \"" << resultsFile << "\"\n";
+    lib.saveAllData();
+    return 0;
+}
+
+// Synthetic libraries for --generate and --bench. Book i has ISBN
+// GEN-<i> and user i has ID U<i>; the loanCount loans are spread evenly
+// over the catalogue and handed out to the users round-robin.
+string generatedISBN(size_t i) { return "GEN-" + to_string(i); }
+string generatedUserID(size_t i) { return "U" + to_string(i); }
+bool generatedOnLoan(size_t i, size_t bookCount, size_t loanCount) {
+    return (i + 1) * loanCount / bookCount != i * loanCount / bookCount;
+}
+
+// Writes books.csv, users.csv and issued.csv in the layout the Library
+// saves. Titles come from a small vocabulary so catalog search has
+// realistic postings, one user in five is faculty, and issue dates go up
+// to 40 days back so some loans are overdue. The same sizes always give
+// the same files. Any journal or snapshot is cleared so the generated
+// files are what the next run loads.
+bool generateDataset(size_t bookCount, size_t userCount, size_t loanCount) {
+    static const char* words[] = {
+        "Advanced", "Applied", "Modern", "Practical", "Introduction", "Systems", "Algorithms", "Data",
+        "Structures", "Networks", "Compilers", "Databases", "Design", "Patterns", "Programming", "Theory",
+        "Analysis", "Machine", "Learning", "Operating", "Concurrency", "Graphics", "Security", "Languages",
+        "Distributed", "Computing", "Software", "Engineering", "Mathematics", "Logic", "Probability", "Statistics" };
+    static const char* firstNames[] = {
+        "Ada", "Alan", "Barbara", "Brian", "Claude", "Donald", "Edsger", "Frances",
+        "Grace", "John", "Ken", "Leslie", "Margaret", "Niklaus", "Robert", "Tony" };
+    static const char* lastNames[] = {
+        "Adams", "Baker", "Chen", "Diaz", "Evans", "Fischer", "Garcia", "Hughes",
+        "Ito", "Jones", "Khan", "Lopez", "Martin", "Novak", "Okafor", "Patel" };
+    static const char* publishers[] = {
+        "Addison-Wesley", "O'Reilly", "Manning", "Prentice Hall", "MIT Press", "Springer",
+        "Wiley", "Pearson", "No Starch", "Packt", "Apress", "Cambridge University Press" };
+    if(userCount == 0)
+        loanCount = 0;
+    loanCount = min(loanCount, bookCount);
+    mt19937 random(253);
+    auto pick = [&](size_t n) { return static_cast<size_t>(random() % n); };
+    time_t now = time(0);
+    string buffer;
+    ofstream booksOut("books.csv", ios::binary | ios::trunc);
+    for(size_t i = 0; i < bookCount; ++i) {
+        string title = words[pick(32)];
+        for(size_t w = 1 + pick(4); w > 0; --w) {
+            title += ' ';
+            title += words[pick(32)];
+        }
+        string author = firstNames[pick(16)];
+        author += ' ';
+        author += static_cast<char>('A' + pick(26));
+        author += ". ";
+        author += lastNames[pick(16)];
+        BookStatus status = generatedOnLoan(i, bookCount, loanCount) ? BookStatus::Borrowed : BookStatus::Available;
+        Book book(title, author, publishers[pick(12)], 1950 + static_cast<int>(pick(76)), generatedISBN(i), status, "", 0);
+        buffer += book.toCSV();
+        buffer += '\n';
+    }
+    booksOut << buffer;
+    buffer.clear();
+    ofstream usersOut("users.csv", ios::binary | ios::trunc);
+    RoleId student = policies.named("Student"), faculty = policies.named("Faculty");
+    for(size_t i = 0; i < userCount; ++i) {
+        string name = string(firstNames[pick(16)]) + " " + lastNames[pick(16)];
+        User* u = makeUser(generatedUserID(i), name, "pw" + to_string(i), i % 5 == 0 ? faculty : student);
+        buffer += u->toCSV();
+        buffer += '\n';
+        delete u;
+    }
+    usersOut << buffer;
+    buffer.clear();
+    ofstream issuedOut("issued.csv", ios::binary | ios::trunc);
+    for(size_t i = 0, loan = 0; i < bookCount; ++i) {
+        if(!generatedOnLoan(i, bookCount, loanCount)) continue;
+        buffer += generatedUserID(loan++ % userCount);
+        buffer += ',';
+        buffer += generatedISBN(i);
+        buffer += ',';
+        buffer += to_string(now - static_cast<time_t>(pick(40 * 24 * 3600)));
+        buffer += '\n';
+    }
+    issuedOut << buffer;
+    booksOut.close();
+    usersOut.close();
+    issuedOut.close();
+    ofstream("journal.log", ios::trunc);
+    remove("journal.prev");
+    remove("library.snap");
+    return booksOut && usersOut && issuedOut;
+}
+
+int runGenerate(int argc, char* argv[]) {
+    size_t bookCount, userCount, loanCount;
+    if(argc < 5 || !parseNumber(string_view(argv[2]), bookCount) || !parseNumber(string_view(argv[3]), userCount)
+       || !parseNumber(string_view(argv[4]), loanCount)) {
+        cout << "Usage: " << argv[0] << " --generate <books> <users> <loans>\n";
+        return 1;
+    }
+    if(!generateDataset(bookCount, userCount, loanCount)) {
+        cout << "Error writing the generated data.\n";
+        return 1;
+    }
+    cout << "Generated " << bookCount << " books, " << userCount << " users and "
+         << min(userCount == 0 ? 0 : loanCount, bookCount) << " loans.\n";
+    return 0;
+}
+
+// Latency samples in microseconds, summarised the same way by --bench and
+// --load-test.
+struct LatencySummary {
+    size_t count = 0;
+    double p50 = 0, p99 = 0, max = 0;
+};
+
+LatencySummary summarizeLatencies(vector<double> &samples) {
+    LatencySummary summary;
+    if(samples.empty())
+        return summary;
+    sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples[min(samples.size() - 1, static_cast<size_t>(p * samples.size()))]; };
+    summary.count = samples.size();
+    summary.p50 = percentile(0.50);
+    summary.p99 = percentile(0.99);
+    summary.max = samples.back();
+    return summary;
+}
+
+// Times the engine's hot paths on a generated library of each size and
+// prints one CSV row per operation. Every size is generated in a scratch
+// bench_data directory, so the library in the working directory is left
+// alone. Issues, reservations and returns are timed through the public
+// calls, so the periodic checkpoints they trigger show up in p99 and max.
+int runBenchmark(int argc, char* argv[]) {
+    vector<size_t> scales;
+    for(int i = 2; i < argc; ++i) {
+        size_t scale;
+        if(!parseNumber(string_view(argv[i]), scale) || scale < 10) {
+            cout << "Invalid book count \"" << argv[i] << "\"; give sizes of at least 10.\n";
+            return 1;
+        }
+        scales.push_back(scale);
+    }
+    if(scales.empty())
+        scales = { 10000, 1000000, 10000000 };
+    const size_t lookups = 100000, circulationOps = 10000, fileRepeats = 3;
+    const filesystem::path home = filesystem::current_path();
+    const filesystem::path scratch = home / "bench_data";
+    cout << "books,users,loans,operation,count,seconds,ops_per_second,p50_us,p99_us,max_us,failed,mb_per_second\n";
+    for(size_t bookCount : scales) {
+        size_t userCount = max<size_t>(bookCount / 10, 1), loanCount = bookCount / 10;
+        error_code error;
+        filesystem::remove_all(scratch, error);
+        if(!filesystem::create_directory(scratch, error)) {
+            cout << "Could not create \"" << scratch.string() << "\": " << error.message() << "\n";
+            return 1;
+        }
+        filesystem::current_path(scratch);
+        generateDataset(bookCount, userCount, loanCount);
+        auto report = [&](const char* operation, vector<double> &samples, double seconds, size_t failed, uint64_t bytes = 0) {
+            LatencySummary s = summarizeLatencies(samples);
+            cout << bookCount << ',' << userCount << ',' << loanCount << ',' << operation << ',' << s.count << ','
+                 << seconds << ',' << static_cast<long>(s.count / seconds) << ',' << s.p50 << ',' << s.p99 << ','
+                 << s.max << ',' << failed << ',';
+            if(bytes > 0)
+                cout << bytes / seconds / 1e6;
+            cout << '\n' << flush;
+        };
+        {
+            // Parsing alone, on the generated books.csv: CsvReader and
+            // CsvRow against the getline and stringstream loop the loaders
+            // used to run. Both split every field and convert the numbers.
+            uint64_t bytes = filesystem::file_size("books.csv", error);
+            auto parse = [&](const char* operation, auto pass) {
+                vector<double> samples;
+                double seconds = 0;
+                size_t failed = 0;
+                for(size_t r = 0; r < fileRepeats; ++r) {
+                    auto started = chrono::steady_clock::now();
+                    failed += pass();
+                    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+                    seconds += elapsed;
+                    samples.push_back(elapsed * 1e6);
+                }
+                report(operation, samples, seconds, failed, bytes * fileRepeats);
+            };
+            parse("parseCSV CsvReader", [] {
+                CsvReader reader("books.csv");
+                CsvRow row;
+                string_view line;
+                size_t failed = 0;
+                while(reader.nextLine(line)) {
+                    if(line.empty()) continue;
+                    int year;
+                    time_t expiry = 0;
+                    if(!row.parse(line) || row.size() < 8 || !parseNumber(row[3], year)
+                       || (!row[7].empty() && !parseNumber(row[7], expiry)))
+                        ++failed;
+                }
+                return failed;
+            });
+            parse("parseCSV getline", [] {
+                ifstream in("books.csv");
+                string line, fields[8];
+                size_t failed = 0;
+                while(getline(in, line)) {
+                    if(line.empty()) continue;
+                    stringstream ss(line);
+                    for(string &field : fields)
+                        getline(ss, field, ',');
+                    try {
+                        stoi(fields[3]);
+                        if(!fields[7].empty()) stol(fields[7]);
+                    } catch(const exception&) {
+                        ++failed;
+                    }
+                }
+                return failed;
+            });
+        }
+        {
+            // Move the generated files into data/ so the timings below are
+            // for the segmented layout.
+            Library migrate;
+            migrate.loadAllData();
+            migrate.saveAllData();
+        }
+        auto measure = [&](const char* operation, size_t count, auto op) {
+            vector<double> samples;
+            samples.reserve(count);
+            size_t failed = 0;
+            auto started = chrono::steady_clock::now();
+            for(size_t i = 0; i < count; ++i) {
+                auto sent = chrono::steady_clock::now();
+                if(!op(i))
+                    ++failed;
+                samples.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count());
+            }
+            report(operation, samples, chrono::duration<double>(chrono::steady_clock::now() - started).count(), failed);
+        };
+        {
+            unique_ptr<Library> lib;
+            vector<double> samples;
+            double seconds = 0;
+            for(size_t r = 0; r < fileRepeats; ++r) {
+                lib.reset();
+                lib = make_unique<Library>();
+                auto started = chrono::steady_clock::now();
+                lib->loadAllData();
+                double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+                seconds += elapsed;
+                samples.push_back(elapsed * 1e6);
+            }
+            report("loadAllData", samples, seconds, 0);
+
+            vector<string> isbns(bookCount), userIDs(userCount);
+            vector<size_t> available, onLoan;
+            for(size_t i = 0; i < bookCount; ++i) {
+                isbns[i] = generatedISBN(i);
+                (generatedOnLoan(i, bookCount, loanCount) ? onLoan : available).push_back(i);
+            }
+            for(size_t i = 0; i < userCount; ++i)
+                userIDs[i] = generatedUserID(i);
+            mt19937 random(17);
+            vector<size_t> picks(lookups);
+            for(size_t &p : picks) p = random() % bookCount;
+            measure("searchBookByISBN", lookups, [&](size_t i) { return lib->searchBookByISBN(isbns[picks[i]]) != nullptr; });
+            for(size_t &p : picks) p = random() % userCount;
+            measure("getUserById", lookups, [&](size_t i) { return lib->getUserById(userIDs[picks[i]]) != nullptr; });
+
+            // Each user borrows one more available book, reserves the book
+            // lent to the next user, and then returns the new book on time.
+            size_t issues = min({ circulationOps, userCount, available.size() - 1 });
+            auto okay = [](const OpResult &result) { return result.status == OpStatus::Ok; };
+            measure("issueBook", issues, [&](size_t i) { return okay(lib->issueBook(userIDs[i], isbns[available[i]])); });
+            measure("reserveBook", min(circulationOps, onLoan.size()), [&](size_t j) {
+                return okay(lib->reserveBook(userIDs[(j + 1) % userCount], isbns[onLoan[j]]));
+            });
+            measure("returnBook", issues, [&](size_t i) { return okay(lib->returnBook(userIDs[i], isbns[available[i]], 1)); });
+
+            // The nightly sweep over every open loan, which the 10M-book
+            // default size puts at 1M.
+            measure("runOverdueSweep", fileRepeats, [&](size_t) {
+                return lib->runOverdueSweep(time(0)).openLoans == loanCount;
+            });
+
+            // Each save follows one change, so none is skipped as current.
+            const string &spare = isbns[available[issues]];
+            measure("saveAllData", fileRepeats, [&](size_t r) {
+                if(r % 2 == 0) lib->issueBook(userIDs[0], spare);
+                else lib->returnBook(userIDs[0], spare, 1);
+                return lib->saveAllData();
+            });
+        }
+        filesystem::current_path(home);
+        filesystem::remove_all(scratch, error);
+    }
+#ifdef LMS_METRICS
+    cerr << "metrics " << metrics.toJSON() << "\n";
+#endif
+    return 0;
+}
+
+// Runs desks threads of random issues, returns, reservations and
+// additions against one library while the checkpointer writes it out in
+// the background, then checks the ledger. A desk only returns books it
+// issued, and clears its mark on a book before returning it and sets the
+// mark after an issue succeeds, so finding the mark already set means the
+// same book was lent twice. Runs in a scratch stress_data directory.
+int runStress(int argc, char* argv[]) {
+    size_t desks = max(thread::hardware_concurrency(), 2u), opsPerDesk = 20000;
+    if((argc > 2 && (!parseNumber(string_view(argv[2]), desks) || desks == 0))
+       || (argc > 3 && !parseNumber(string_view(argv[3]), opsPerDesk))) {
+        cout << "Usage: " << argv[0] << " --stress [desks] [operations per desk]\n";
+        return 1;
+    }
+    const size_t bookCount = 2000, userCount = 500;
+    const filesystem::path home = filesystem::current_path();
+    const filesystem::path scratch = home / "stress_data";
+    error_code error;
+    filesystem::remove_all(scratch, error);
+    if(!filesystem::create_directory(scratch, error)) {
+        cout << "Could not create \"" << scratch.string() << "\": " << error.message() << "\n";
+        return 1;
+    }
+    filesystem::current_path(scratch);
+    generateDataset(bookCount, userCount, 0);
+
+    struct Held { string userID, isbn; BookHandle book; };
+    vector<atomic<size_t>> lentBy(bookCount + desks * opsPerDesk);
+    vector<vector<Held>> held(desks);
+    vector<string> addedBooks, addedUsers;
+    mutex addedLock;
+    atomic<size_t> violations(0), issues(0), returns(0), reservations(0), rejected(0);
+    auto violation = [&](const string &what) {
+        static mutex out;
+        lock_guard<mutex> lock(out);
+        if(++violations <= 20)
+            cout << "violation: " << what << "\n";
+    };
+    size_t bookTotal, userTotal, issuedTotal;
+    double seconds;
+    {
+        Library lib;
+        lib.loadAllData();
+        vector<thread> threads;
+        auto started = chrono::steady_clock::now();
+        for(size_t d = 0; d < desks; ++d)
+            threads.emplace_back([&, d] {
+                mt19937 random(static_cast<unsigned>(d + 1));
+                vector<Held> &mine = held[d];
+                for(size_t i = 0; i < opsPerDesk; ++i) {
+                    unsigned roll = random() % 100;
+                    string uid = generatedUserID(random() % userCount);
+                    string isbn = generatedISBN(random() % bookCount);
+                    if(roll < 2) {
+                        string id = "S" + to_string(d) + "-" + to_string(i);
+                        if(lib.addNewBook(Book("Stress " + id, "Desk " + to_string(d), "Stress", 2000, id)) != OpStatus::Ok)
+                            violation("could not add book " + id);
+                        lock_guard<mutex> lock(addedLock);
+                        addedBooks.push_back(id);
+                    } else if(roll < 3) {
+                        string id = "S" + to_string(d) + "-" + to_string(i);
+                        if(lib.addNewUser(makeUser(id, "Stress " + id, "pw", policies.named("Student"))) != OpStatus::Ok)
+                            violation("could not add user " + id);
+                        lock_guard<mutex> lock(addedLock);
+                        addedUsers.push_back(id);
+                    } else if(roll < 40 && !mine.empty()) {
+                        size_t pick = random() % mine.size();
+                        Held loan = mine[pick];
+                        mine[pick] = mine.back();
+                        mine.pop_back();
+                        if(lentBy[loan.book].exchange(0) != d + 1)
+                            violation(loan.isbn + " was taken from desk " + to_string(d));
+                        OpResult result = lib.returnBook(loan.userID, loan.isbn, 1 + static_cast<int>(random() % 15));
+                        if(result.status != OpStatus::Ok)
+                            violation("return of " + loan.isbn + ": " + opStatusName(result.status));
+                        ++returns;
+                    } else if(roll < 50) {
+                        if(lib.reserveBook(uid, isbn).status == OpStatus::Ok) ++reservations;
+                        else ++rejected;
+                    } else {
+                        if(roll >= 95) {
+                            lock_guard<mutex> lock(addedLock);
+                            if(!addedBooks.empty())
+                                isbn = addedBooks[random() % addedBooks.size()];
+                        }
+                        if(lib.issueBook(uid, isbn).status != OpStatus::Ok) {
+                            ++rejected;
+                            continue;
+                        }
+                        BookHandle h = lib.findBook(isbn);
+                        size_t previous = lentBy[h].exchange(d + 1);
+                        if(previous != 0)
+                            violation(isbn + " issued by desk " + to_string(d) + " while desk "
+                                      + to_string(previous - 1) + " holds it");
+                        mine.push_back({ uid, isbn, h });
+                        ++issues;
+                    }
+                }
+            });
+        for(thread &t : threads)
+            t.join();
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        bookTotal = bookCount + addedBooks.size();
+        userTotal = userCount + addedUsers.size();
+        issuedTotal = 0;
+        for(const vector<Held> &mine : held)
+            issuedTotal += mine.size();
+        if(issues != returns + issuedTotal)
+            violation(to_string(issues) + " issues and " + to_string(returns) + " returns leave "
+                      + to_string(issuedTotal) + " loans at the desks");
+        if(lib.getIssuedCount() != issuedTotal)
+            violation("the ledger has " + to_string(lib.getIssuedCount()) + " loans, the desks "
+                      + to_string(issuedTotal));
+        if(lib.getUserCount() != userTotal)
+            violation("the library has " + to_string(lib.getUserCount()) + " users, expected " + to_string(userTotal));
+        if(lib.getBook(bookTotal - 1) == nullptr || lib.getBook(bookTotal) != nullptr)
+            violation("the library does not have " + to_string(bookTotal) + " books");
+        size_t unreadable;
+        if(lib.loanHistory(HistoryQuery(), unreadable).size() != returns || unreadable > 0)
+            violation("the loan history does not have " + to_string(returns) + " returns");
+        for(BookHandle h = 0; h < bookTotal; ++h) {
+            IssuedRecord loan;
+            bool lent = lib.findLoan(h, loan);
+            if(lent != (lentBy[h] != 0) || (lent != (lib.getBook(h)->getStatus() == BookStatus::Borrowed)))
+                violation("book " + to_string(h) + " disagrees with the ledger");
+        }
+        for(size_t i = 0; i < userCount; ++i) {
+            User* u = lib.getUserById(generatedUserID(i));
+            size_t loans = lib.loansOf(u->getID()).size();
+            if(loans != u->getAccount().getBorrowedCount() || loans > static_cast<size_t>(u->getPolicy().maxBooks))
+                violation("user " + generatedUserID(i) + " has " + to_string(loans) + " loans");
+        }
+        lib.saveAllData();
+    }
+    {
+        Library reloaded;
+        reloaded.loadAllData();
+        if(reloaded.getIssuedCount() != issuedTotal || reloaded.getUserCount() != userTotal
+           || reloaded.getBook(bookTotal - 1) == nullptr || reloaded.getBook(bookTotal) != nullptr)
+            violation("the counts changed when the library was reloaded");
+        for(BookHandle h = 0; h < bookTotal; ++h) {
+            IssuedRecord loan;
+            if(reloaded.findLoan(h, loan) != (lentBy[h] != 0))
+                violation("book " + to_string(h) + " changed when the library was reloaded");
+        }
+    }
+    filesystem::current_path(home);
+    filesystem::remove_all(scratch, error);
+    cout << desks << " desks x " << opsPerDesk << " operations in " << seconds << " s: " << issues << " issues, "
+         << returns << " returns, " << reservations << " reservations, " << addedBooks.size() << " books and "
+         << addedUsers.size() << " users added, " << rejected << " requests refused, " << issuedTotal
+         << " books still on loan, " << violations << " violations\n";
+    return violations == 0 ? 0 : 1;
+}
+
+// --policy-test borrows under the rules of a policy.csv written to a
+// scratch policy_data directory, with one role whose pending fine
+// clearance blocks borrowing and one whose does not.
+int runPolicyTest() {
+    const filesystem::path home = filesystem::current_path();
+    const filesystem::path scratch = home / "policy_data";
+    error_code error;
+    filesystem::remove_all(scratch, error);
+    if(!filesystem::create_directory(scratch, error)) {
+        cout << "Could not create \"" << scratch.string() << "\": " << error.message() << "\n";
+        return 1;
+    }
+    filesystem::current_path(scratch);
+    {
+        ofstream policy("policy.csv");
+        policy << "role,maxBooks,loanDays,finePerDay,graceDays,holdDays,clearanceBlocks,librarian\n"
+               << "Student,3,15,10,0,5,yes,no\n"
+               << "Staff,3,15,10,0,5,no,no\n";
+    }
+    int failures = 0;
+    auto check = [&](bool ok, const string &what) {
+        cout << (ok ? "ok      " : "FAILED  ") << what << "\n" << flush;
+        if(!ok) ++failures;
+    };
+    {
+        Library lib;
+        lib.loadAllData();
+        struct Case { const char* role; const char* uid; bool blocks; };
+        const Case cases[] = { { "Student", "P1", true }, { "Staff", "P2", false } };
+        for(const Case &c : cases) {
+            string role = c.role, first = string(c.uid) + "-A", second = string(c.uid) + "-B";
+            lib.addNewBook(Book("Policy Test", "Author", "Publisher", 2000, first));
+            lib.addNewBook(Book("Policy Test", "Author", "Publisher", 2000, second));
+            lib.addNewUser(makeUser(c.uid, role, "pw", policies.named(role)));
+            check(lib.issueBook(c.uid, first).status == OpStatus::Ok, role + " borrows a book");
+            OpResult late = lib.returnBook(c.uid, first, 20);
+            check(late.status == OpStatus::Ok && late.fine == 50, role + " is fined 50 for returning it 5 days late");
+            check(lib.issueBook(c.uid, second).status == OpStatus::FineOutstanding, role + " with a fine is refused");
+            check(lib.requestFineClearance(c.uid) == OpStatus::Ok, role + " asks for the fine to be cleared");
+            // A fine always blocks, so it is dropped here to leave the
+            // pending request as the only thing in the way.
+            lib.getUserById(c.uid)->getAccount().clearFine();
+            OpStatus status = lib.issueBook(c.uid, second).status;
+            check(c.blocks ? status == OpStatus::FineOutstanding : status == OpStatus::Ok,
+                  role + (c.blocks ? " is refused" : " may borrow") + " while the clearance is pending");
+        }
+    }
+    filesystem::current_path(home);
+    filesystem::remove_all(scratch, error);
+    cout << (failures == 0 ? "All policy checks passed.\n" : "Some policy checks failed.\n");
+    return failures == 0 ? 0 : 1;
+}
+
+void addSampleData(Library &library) {
+    if(library.searchBookByISBN("ISBN-001") == nullptr) {
+        library.addNewBook(Book("C++ Primer", "Stanley Lippman", "Addison-Wesley", 2012, "ISBN-001"));
+        library.addNewBook(Book("Effective C++", "Scott Meyers", "O'Reilly", 2005, "ISBN-002"));
+        library.addNewBook(Book("The C++ Programming Language", "Bjarne Stroustrup", "Addison-Wesley", 2013, "ISBN-003"));
+        library.addNewBook(Book("Programming: Principles and Practice", "Bjarne Stroustrup", "Addison-Wesley", 2014, "ISBN-004"));
+        library.addNewBook(Book("Modern C++ Design", "Andrei Alexandrescu", "Addison-Wesley", 2001, "ISBN-005"));
+        library.addNewBook(Book("C++ Concurrency in Action", "Anthony Williams", "Manning", 2019, "ISBN-006"));
+        library.addNewBook(Book("Clean Code", "Robert C. Martin", "Prentice Hall", 2008, "ISBN-007"));
+        library.addNewBook(Book("Design Patterns", "Erich Gamma", "Addison-Wesley", 1994, "ISBN-008"));
+        library.addNewBook(Book("Effective STL", "Scott Meyers", "O'Reilly", 2001, "ISBN-009"));
+        library.addNewBook(Book("The Pragmatic Programmer", "Andrew Hunt", "Addison-Wesley", 1999, "ISBN-010"));
+    }
+    if(library.getUserById("1") == nullptr) {
+        RoleId student = policies.named("Student"), faculty = policies.named("Faculty");
+        library.addNewUser(makeUser("1", "Alice", hashPassword("alicepwd"), student));
+        library.addNewUser(makeUser("2", "Bob", hashPassword("bobpwd"), student));
+        library.addNewUser(makeUser("3", "Charlie", hashPassword("charliepwd"), student));
+        library.addNewUser(makeUser("4", "David", hashPassword("davidpwd"), student));
+        library.addNewUser(makeUser("5", "Eva", hashPassword("evapwd"), student));
+        library.addNewUser(makeUser("6", "Prof. Smith", hashPassword("smithpwd"), faculty));
+        library.addNewUser(makeUser("7", "Prof. Johnson", hashPassword("johnsonpwd"), faculty));
+        library.addNewUser(makeUser("8", "Prof. Williams", hashPassword("williampwd"), faculty));
+        library.addNewUser(makeUser("9", "Librarian Karen", hashPassword("karenpwd"), policies.named("Librarian")));
+    }
+}
+
+#ifdef __linux__
+// --serve speaks a line protocol over loopback TCP or a Unix socket. Each
+// request is one line of space-separated words and gets exactly one reply
+// line starting with OK or ERR; clients may pipeline requests.
+//   LOGIN <id> <password>   TOKEN <token>   LOGOUT   PING   QUIT
+//   SEARCH <words...>       BOOK <isbn>
+//   ISSUE <isbn>   RETURN <isbn> <days>   RESERVE <isbn>   LOANS
+//   FINE   CLEARFINE   APPROVE <id>   (APPROVE is for librarians)
+
+// "<port>" means 127.0.0.1:<port>; anything else is a Unix socket path.
+int openSocket(const string &address, bool listening) {
+    int port = 0;
+    bool tcp = parseNumber(address, port);
+    if(tcp && (port <= 0 || port > 65535)) return -1;
+    int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    int rc;
+    if(tcp) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        if(listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            rc = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        } else {
+            rc = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    } else {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(address.empty() || address.size() >= sizeof(addr.sun_path)) {
+            ::close(fd);
+            return -1;
+        }
+        memcpy(addr.sun_path, address.data(), address.size());
+        if(listening) {
+            ::unlink(address.c_str());
+            rc = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        } else {
+            rc = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+    }
+    if(rc == 0 && listening)
+        rc = ::listen(fd, SOMAXCONN);
+    if(rc != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+volatile sig_atomic_t serverStopping = 0;
+void stopServer(int) { serverStopping = 1; }
+
+// Single-threaded epoll loop. Reads run to completion on the loop thread;
+// each is a few microseconds of in-memory work under shared locks. LOGIN
+// and the requests that change the library go to a pool of workers
+// instead: checking a password takes tens of milliseconds by design, and
+// a change waits for its journal record to be synced to disk. The loop
+// serves other connections meanwhile, and the workers' changes share
+// fsyncs through the journal's group commit. The connection reads no
+// further requests until the answer comes back through wakeFd.
+class RequestServer {
+private:
+    struct Connection {
+        string in, out;
+        string userID;         // empty until LOGIN or TOKEN succeeds
+        string token;
+        uint64_t serial = 0;   // tells a reused descriptor from its predecessor
+        uint32_t watching = 0;
+        bool waiting = false;  // a request is with the workers
+        bool eof = false;
+        bool closing = false;
+    };
+    struct Job {
+        int fd;
+        uint64_t serial;
+        function<string()> work;
+        string loginAs;   // LOGIN only: who the connection is once the answer is OK
+        string answer;
+    };
+    static const size_t maxRequestLine = 64 * 1024;
+    static const size_t searchReplyLimit = 20;
+    Library &lib;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    bool tcp = false;
+    uint64_t nextSerial = 0;
+    unordered_map<int, Connection> connections;
+    vector<thread> workers;
+    mutex jobLock;
+    condition_variable jobQueued;
+    deque<Job> jobQueue;
+    vector<Job> jobsDone;
+    bool workersStopping = false;
+
+    void worker() {
+        unique_lock<mutex> lock(jobLock);
+        while(true) {
+            jobQueued.wait(lock, [&] { return workersStopping || !jobQueue.empty(); });
+            if(workersStopping) return;
+            Job job = std::move(jobQueue.front());
+            jobQueue.pop_front();
+            lock.unlock();
+            job.answer = job.work();
+            job.work = nullptr;
+            lock.lock();
+            jobsDone.push_back(std::move(job));
+            eventfd_write(wakeFd, 1);
+        }
+    }
+    // Hands work to the pool; the connection waits for the answer.
+    string dispatch(int fd, Connection &c, function<string()> work, string loginAs = string()) {
+        {
+            lock_guard<mutex> lock(jobLock);
+            jobQueue.push_back(Job { fd, c.serial, std::move(work), std::move(loginAs), string() });
+        }
+        jobQueued.notify_one();
+        c.waiting = true;
+        return string();
+    }
+    void finishJobs() {
+        eventfd_t count;
+        eventfd_read(wakeFd, &count);
+        vector<Job> done;
+        {
+            lock_guard<mutex> lock(jobLock);
+            done.swap(jobsDone);
+        }
+        for(Job &job : done) {
+            auto it = connections.find(job.fd);
+            if(it == connections.end() || it->second.serial != job.serial) continue;
+            Connection &c = it->second;
+            c.waiting = false;
+            if(!job.loginAs.empty() && job.answer.compare(0, 3, "OK ") == 0) {
+                c.userID = job.loginAs;
+                c.token = job.answer.substr(job.answer.rfind(' ') + 1);
+            }
+            c.out += job.answer;
+            c.out += '\n';
+            answerRequests(job.fd, c);
+            service(job.fd, c);
+        }
+    }
+
+    static string reply(OpStatus s) {
+        return s == OpStatus::Ok ? string("OK") : string("ERR ") + opStatusName(s);
+    }
+    string handle(int fd, Connection &c, string_view line) {
+        vector<string_view> words;
+        size_t pos = 0;
+        while(pos < line.size()) {
+            size_t end = line.find(' ', pos);
+            if(end == string_view::npos) end = line.size();
+            if(end > pos) words.push_back(line.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        if(words.empty()) return "ERR Empty";
+        string_view cmd = words[0];
+        if(cmd == "PING") return "OK";
+        if(cmd == "STATS") {
+#ifdef LMS_METRICS
+            return "OK " + metrics.toJSON();
+#else
+            return "ERR MetricsDisabled";
+#endif
+        }
+        if(cmd == "QUIT") {
+            c.closing = true;
+            return "OK";
+        }
+        if(cmd == "LOGIN") {
+            if(words.size() != 3) return "ERR Usage";
+            string uid(words[1]);
+            return dispatch(fd, c, [this, uid, password = string(words[2])]() mutable {
+                User* u = nullptr;
+                if(lib.authenticate(uid, password) == OpStatus::Ok)
+                    u = lib.getUserById(uid);
+                password.clear();
+                return u ? "OK " + roleName(u->getRole()) + " " + lib.openSession(uid) : string("ERR InvalidLogin");
+            }, uid);
+        }
+        if(cmd == "TOKEN") {
+            if(words.size() != 2) return "ERR Usage";
+            string uid;
+            User* u = nullptr;
+            if(lib.resumeSession(string(words[1]), uid))
+                u = lib.getUserById(uid);
+            if(!u) return "ERR InvalidToken";
+            c.userID = uid;
+            c.token = string(words[1]);
+            return "OK " + roleName(u->getRole()) + " " + uid;
+        }
+        if(cmd == "LOGOUT") {
+            if(!c.token.empty())
+                lib.closeSession(c.token);
+            c.userID.clear();
+            c.token.clear();
+            return "OK";
+        }
+        if(cmd == "SEARCH") {
+            string query(line.substr(line.find("SEARCH") + 6));
+            CatalogSearch::Results results = lib.searchCatalog(query, 0, searchReplyLimit);
+            string out = "OK " + to_string(results.total);
+            for(BookHandle h : results.hits) {
+                Book* b = lib.getBook(h);
+                out += ' ';
+                out += b->getISBN();
+            }
+            return out;
+        }
+        if(cmd == "BOOK") {
+            if(words.size() != 2) return "ERR Usage";
+            string json;
+            if(!lib.bookToJSON(lib.findBook(string(words[1])), json)) return "ERR BookNotFound";
+            json.pop_back();
+            return "OK " + json;
+        }
+        if(c.userID.empty()) return "ERR NotLoggedIn";
+        if(cmd == "ISSUE") {
+            if(words.size() != 2) return "ERR Usage";
+            return dispatch(fd, c, [this, uid = c.userID, isbn = string(words[1])] {
+                return reply(lib.issueBook(uid, isbn).status);
+            });
+        }
+        if(cmd == "RETURN") {
+            int days;
+            if(words.size() != 3 || !parseNumber(words[2], days) || days < 0) return "ERR Usage";
+            return dispatch(fd, c, [this, uid = c.userID, isbn = string(words[1]), days] {
+                return reply(lib.returnBook(uid, isbn, days).status);
+            });
+        }
+        if(cmd == "RESERVE") {
+            if(words.size() != 2) return "ERR Usage";
+            return dispatch(fd, c, [this, uid = c.userID, isbn = string(words[1])] {
+                OpResult result = lib.reserveBook(uid, isbn);
+                if(result.status != OpStatus::Ok) return reply(result.status);
+                return "OK " + to_string(result.queuePosition);
+            });
+        }
+        if(cmd == "LOANS") {
+            vector<IssuedRecord> loans = lib.loansOf(c.userID);
+            string out = "OK " + to_string(loans.size());
+            for(const IssuedRecord &r : loans) {
+                out += ' ';
+                out += lib.getBook(r.book)->getISBN();
+            }
+            return out;
+        }
+        if(cmd == "FINE") {
+            Account account;
+            if(!lib.getAccount(c.userID, account)) return "ERR UserNotFound";
+            return "OK " + formatAmount(account.getFine()) + " " + formatAmount(account.getAccruedFine())
+                 + (account.isFineSettlementPending() ? " pending" : " none");
+        }
+        if(cmd == "CLEARFINE")
+            return dispatch(fd, c, [this, uid = c.userID] { return reply(lib.requestFineClearance(uid)); });
+        if(cmd == "APPROVE") {
+            if(words.size() != 2) return "ERR Usage";
+            User* self = lib.getUserById(c.userID);
+            if(!self || !self->getPolicy().librarian) return reply(OpStatus::NotPermitted);
+            return dispatch(fd, c, [this, uid = string(words[1])] { return reply(lib.approveFineClearance(uid)); });
+        }
+        return "ERR UnknownCommand";
+    }
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, op, fd, &ev);
+    }
+    void acceptAll() {
+        while(true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd < 0) return;
+            if(tcp) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            Connection &c = connections[fd];
+            c.serial = ++nextSerial;
+            c.watching = EPOLLIN | EPOLLRDHUP;
+            watch(fd, c.watching, EPOLL_CTL_ADD);
+        }
+    }
+    void closeConnection(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections.erase(fd);
+    }
+    // Sets eof once the peer has shut down its side.
+    void receive(int fd, Connection &c) {
+        char buf[16 * 1024];
+        while(true) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if(n > 0) {
+                c.in.append(buf, n);
+                continue;
+            }
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if(n < 0 && errno == EINTR) continue;
+            c.eof = true;
+            break;
+        }
+    }
+    // Answers the complete requests in c.in, stopping after one sent to
+    // the workers until its answer is back.
+    void answerRequests(int fd, Connection &c) {
+        size_t start = 0, newline;
+        while(!c.closing && !c.waiting && (newline = c.in.find('\n', start)) != string::npos) {
+            string_view line(c.in.data() + start, newline - start);
+            if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            string answer = handle(fd, c, line);
+            start = newline + 1;
+            if(c.waiting) break;
+            c.out += answer;
+            c.out += '\n';
+        }
+        c.in.erase(0, start);
+        if(!c.waiting && c.in.size() > maxRequestLine) {
+            c.out += "ERR RequestTooLong\n";
+            c.closing = true;
+        }
+    }
+    // Sends what it can, then closes the connection if it is finished or
+    // broken, or else watches for what it is ready for next. A connection
+    // waiting on the workers or at end of input reads nothing more.
+    void service(int fd, Connection &c) {
+        if(!flush(fd, c) || ((c.closing || c.eof) && !c.waiting && c.out.empty())) {
+            closeConnection(fd);
+            return;
+        }
+        uint32_t events = c.waiting || c.eof ? 0 : EPOLLIN | EPOLLRDHUP;
+        if(!c.out.empty()) events |= EPOLLOUT;
+        if(events != c.watching) {
+            c.watching = events;
+            watch(fd, events, EPOLL_CTL_MOD);
+        }
+    }
+    // Returns false on a write error.
+    bool flush(int fd, Connection &c) {
+        size_t sent = 0;
+        while(sent < c.out.size()) {
+            ssize_t n = ::send(fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+            if(n > 0) {
+                sent += n;
+                continue;
+            }
+            if(n < 0 && errno == EINTR) continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false;
+        }
+        c.out.erase(0, sent);
+        return true;
+    }
+public:
+    explicit RequestServer(Library &library) : lib(library) {}
+    RequestServer(const RequestServer&) = delete;
+    RequestServer& operator=(const RequestServer&) = delete;
+    bool start(const string &address) {
+        int port;
+        tcp = parseNumber(address, port);
+        listenFd = openSocket(address, true);
+        if(listenFd < 0) return false;
+        fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(epollFd < 0 || wakeFd < 0) return false;
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+        // A change spends most of its time waiting for fsync, so there are
+        // more workers than cores to give group commit something to batch.
+        for(unsigned i = 0; i < max(8u, thread::hardware_concurrency()); ++i)
+            workers.emplace_back([this] { worker(); });
+        return true;
+    }
+    // Serves until SIGINT or SIGTERM. Metrics builds also log the
+    // counters once a minute.
+    void run() {
+        epoll_event events[64];
+#ifdef LMS_METRICS
+        auto nextStats = chrono::steady_clock::now() + chrono::minutes(1);
+#endif
+        while(!serverStopping) {
+            int n = epoll_wait(epollFd, events, 64, 500);
+            if(n < 0 && errno != EINTR) break;
+#ifdef LMS_METRICS
+            if(chrono::steady_clock::now() >= nextStats) {
+                cout << "metrics " << metrics.toJSON() << endl;
+                nextStats += chrono::minutes(1);
+            }
+#endif
+            for(int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if(fd == listenFd) {
+                    acceptAll();
+                    continue;
+                }
+                if(fd == wakeFd) {
+                    finishJobs();
+                    continue;
+                }
+                auto it = connections.find(fd);
+                if(it == connections.end()) continue;
+                Connection &c = it->second;
+                if(!c.waiting && !c.eof)
+                    receive(fd, c);
+                answerRequests(fd, c);
+                // A peer that hung up completely cannot take replies, but
+                // the requests it sent before still count.
+                if(events[i].events & (EPOLLHUP | EPOLLERR))
+                    closeConnection(fd);
+                else
+                    service(fd, c);
+            }
+        }
+    }
+    ~RequestServer() {
+        {
+            lock_guard<mutex> lock(jobLock);
+            workersStopping = true;
+        }
+        jobQueued.notify_all();
+        for(thread &w : workers)
+            w.join();
+        if(wakeFd >= 0) ::close(wakeFd);
+        for(const auto &entry : connections)
+            ::close(entry.first);
+        if(epollFd >= 0) ::close(epollFd);
+        if(listenFd >= 0) ::close(listenFd);
+    }
+};
+
+int runServer(Library &lib, const string &address) {
+    if(!lib.loadAllData())
+        return 1;
+    addSampleData(lib);
+    RequestServer server(lib);
+    if(!server.start(address)) {
+        cout << "Could not listen on \"" << address << "\": " << strerror(errno) << "\n";
+        return 1;
+    }
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    cout << "Serving requests on \"" << address << "\". Press Ctrl+C to stop.\n" << flush;
+    server.run();
+#ifdef LMS_METRICS
+    cout << "metrics " << metrics.toJSON() << "\n";
+#endif
+    cout << "Server stopped.\n";
+    lib.saveAllData();
+    return 0;
+}
+
+// Load generator for --serve: several client connections, each on its own
+// thread, send requests one at a time and time each round trip.
+int runLoadTest(int argc, char* argv[]) {
+    if(argc < 5) {
+        cout << "Usage: " << argv[0] << " --load-test <port|socket> <userID> <password>"
+             << " [connections] [requests] [query]\n";
+        return 1;
+    }
+    string address = argv[2], uid = argv[3], password = argv[4];
+    int connectionCount = 4, requestCount = 10000;
+    if(argc > 5 && (!parseNumber(string_view(argv[5]), connectionCount) || connectionCount <= 0)) {
+        cout << "Invalid connection count \"" << argv[5] << "\"\n";
+        return 1;
+    }
+    if(argc > 6 && (!parseNumber(string_view(argv[6]), requestCount) || requestCount <= 0)) {
+        cout << "Invalid request count \"" << argv[6] << "\"\n";
+        return 1;
+    }
+    string query = argc > 7 ? argv[7] : "c++";
+    vector<vector<double>> latencies(connectionCount);
+    vector<size_t> errors(connectionCount, 0);
+    atomic<int> failed { 0 };
+    auto started = chrono::steady_clock::now();
+    vector<thread> clients;
+    for(int t = 0; t < connectionCount; ++t) {
+        clients.emplace_back([&, t] {
+            int fd = openSocket(address, false);
+            if(fd < 0) {
+                ++failed;
+                return;
+            }
+            string pending;
+            auto call = [&](const string &request, string &answer) {
+                string line = request + "\n";
+                if(::send(fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size()))
+                    return false;
+                char buf[4096];
+                size_t newline;
+                while((newline = pending.find('\n')) == string::npos) {
+                    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+                    if(n <= 0) return false;
+                    pending.append(buf, n);
+                }
+                answer.assign(pending, 0, newline);
+                pending.erase(0, newline + 1);
+                return true;
+            };
+            string answer;
+            if(!call("LOGIN " + uid + " " + password, answer) || answer.compare(0, 2, "OK") != 0) {
+                ++failed;
+                ::close(fd);
+                return;
+            }
+            vector<string> isbns;
+            if(call("SEARCH " + query, answer)) {
+                istringstream words(answer);
+                string word;
+                words >> word >> word;
+                while(words >> word)
+                    isbns.push_back(word);
+            }
+            latencies[t].reserve(requestCount);
+            for(int i = 0; i < requestCount; ++i) {
+                string request;
+                const string &isbn = isbns.empty() ? query : isbns[(i / 4 + t) % isbns.size()];
+                switch(isbns.empty() ? 0 : i % 4) {
+                    case 0: request = "SEARCH " + query; break;
+                    case 1: request = "BOOK " + isbn; break;
+                    case 2: request = "ISSUE " + isbn; break;
+                    default: request = "RETURN " + isbn + " 1"; break;
+                }
+                auto sent = chrono::steady_clock::now();
+                if(!call(request, answer)) {
+                    ++failed;
+                    break;
+                }
+                latencies[t].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count());
+                if(answer.compare(0, 2, "OK") != 0)
+                    ++errors[t];
+            }
+            call("QUIT", answer);
+            ::close(fd);
+        });
+    }
+    for(thread &client : clients)
+        client.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    vector<double> all;
+    size_t errorReplies = 0;
+    for(int t = 0; t < connectionCount; ++t) {
+        all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+        errorReplies += errors[t];
+    }
+    if(failed > 0)
+        cout << failed << " of " << connectionCount << " connections failed.\n";
+    if(all.empty()) {
+        cout << "No requests completed.\n";
+        return 1;
+    }
+    LatencySummary latency = summarizeLatencies(all);
+    cout << latency.count << " requests over " << connectionCount << " connections in " << seconds << " s ("
+         << static_cast<long>(latency.count / seconds) << " requests/s)\n";
+    cout << "latency p50 " << latency.p50 << " us, p99 " << latency.p99 << " us, max " << latency.max << " us\n";
+    cout << errorReplies << " requests were answered with ERR.\n";
+    return failed > 0 ? 1 : 0;
+}
+
+// --recovery-test checks that the journal brings back what a crash cut
+// short. Each case runs in a scratch recovery_data directory: a child
+// process loads the library, makes its change and is killed with SIGKILL
+// before it can save, then the parent loads the library twice, once
+// replaying the journal and once from the checkpoint the replay wrote.
+int runRecoveryTest() {
+    const filesystem::path home = filesystem::current_path();
+    const filesystem::path scratch = home / "recovery_data";
+    error_code error;
+    filesystem::remove_all(scratch, error);
+    if(!filesystem::create_directory(scratch, error)) {
+        cout << "Could not create \"" << scratch.string() << "\": " << error.message() << "\n";
+        return 1;
+    }
+    filesystem::current_path(scratch);
+    int failures = 0;
+    auto check = [&](bool ok, const string &what) {
+        cout << (ok ? "ok      " : "FAILED  ") << what << "\n" << flush;
+        if(!ok) ++failures;
+    };
+    auto crashAfter = [](auto change) {
+        cout << flush;
+        pid_t child = fork();
+        if(child == 0) {
+            Library* lib = new Library;
+            lib->loadAllData();
+            change(*lib);
+            raise(SIGKILL);
+            _exit(1);
+        }
+        int status = 0;
+        return child > 0 && waitpid(child, &status, 0) == child && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL;
+    };
+    const char* reloads[2] = { "after replay", "after the replay's checkpoint" };
+
+    // A plain-text password is rehashed at the first login.
+    {
+        Library lib;
+        lib.loadAllData();
+        lib.addNewUser(makeUser("R1", "Rita", "ritapwd", policies.named("Student")));
+        lib.saveAllData();
+    }
+    check(crashAfter([](Library &lib) { lib.authenticate("R1", "ritapwd"); }),
+          "killed after logging in with a plain-text password");
+    for(const char* reload : reloads) {
+        Library lib;
+        lib.loadAllData();
+        User* u = lib.getUserById("R1");
+        check(u && isPasswordHash(u->getPassword()) && u->getName() == "Rita",
+              string("password stays hashed ") + reload);
+        check(lib.authenticate("R1", "ritapwd") == OpStatus::Ok, string("password still accepted ") + reload);
+    }
+
+    filesystem::current_path(home);
+    filesystem::remove_all(scratch, error);
+    cout << (failures == 0 ? "All recovery checks passed.\n" : "Some recovery checks failed.\n");
+    return failures == 0 ? 0 : 1;
+}
+#endif
+
+int main(int argc, char* argv[]){
+    Library library;
+    library.setNotices(&cout);
+    if(argc > 1) {
+        string option = argv[1];
+        if(option == "--csv-to-snapshot")
+            return library.convertCSVToSnapshot() ? 0 : 1;
+        if(option == "--snapshot-to-csv")
+            return library.convertSnapshotToCSV() ? 0 : 1;
+        if(option == "--export")
+            return runExport(library, argc, argv);
+        if(option == "--report")
+            return runReport(library, argc, argv);
+        if(option == "--history")
+            return runHistory(library, argc, argv);
+        if(option == "--hash-passwords") {
+            if(!library.loadAllData())
+                return 1;
+            size_t hashed = library.hashStoredPasswords();
+            cout << "Hashed " << hashed << " plain-text password(s).\n";
+            return library.saveAllData() ? 0 : 1;
+        }
+        if(option == "--overdue-sweep") {
+            if(!library.loadAllData())
+                return 1;
+            runOverdueSweepAndReport(library, argc > 2 ? argv[2] : "overdue_report.csv");
+            return 0;
+        }
+        if(option == "--bulk-import" && argc > 2)
+            return runBulkImport(library, argv[2], argc > 3 ? argv[3] : "bulk_results.csv");
+        if(option == "--generate")
+            return runGenerate(argc, argv);
+        if(option == "--bench")
+            return runBenchmark(argc, argv);
+        if(option == "--stress")
+            return runStress(argc, argv);
+        if(option == "--policy-test")
+            return runPolicyTest();
+#ifdef __linux__
+        if(option == "--serve" && argc > 2)
+            return runServer(library, argv[2]);
+        if(option == "--load-test")
+            return runLoadTest(argc, argv);
+        if(option == "--recovery-test")
+            return runRecoveryTest();
+#endif
+        cout << "Unknown option " << option << "\n"
+             << "Usage: " << argv[0] << " [--csv-to-snapshot | --snapshot-to-csv | --hash-passwords | --export <books|users|issued> <file>"
+             << " | --report <loans-by-author|utilization-by-year|by-publisher> <file>"
+             << " | --history <file> [isbn=ISBN] [user=ID] [from=DATE] [to=DATE]"
+             << " | --overdue-sweep [report.csv] | --bulk-import <ops.csv> [results.csv]"
+             << " | --generate <books> <users> <loans> | --bench [books...] | --stress [desks] [operations] | --policy-test"
+             << " | --serve <port|socket>"
+             << " | --load-test <port|socket> <userID> <password> [connections] [requests] [query]"
+             << " | --recovery-test]\n";
+        return 1;
+    }
+    if(!library.loadAllData())
+        return 1;
+    addSampleData(library);
+    int mainChoice;
+    while (true) {
+        cout << "\n--- Library Management System ---\n";
+        cout << "1. Login\n";
+        cout << "2. Exit\n";
+        cout << "Enter your choice: ";
+        if(!(cin >> mainChoice)) {
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "Invalid input. Try again.\n";
+            continue;
+        }
+        if(mainChoice == 2)
+            break;
+        if(mainChoice != 1) {
+            cout << "Invalid choice.\n";
+            continue;
+        }
+        library.expireReservations(time(0));
+        User* currentUser = login(library);
+        if(!currentUser)
+            continue;
+        if(currentUser->getPolicy().librarian)
+            librarianMenu(library, currentUser);
+        else
+            patronMenu(library, currentUser);
+    }
+    library.saveAllData();
+    cout << "Goodbye!\n";
+    return 0;
+}